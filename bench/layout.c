@@ -0,0 +1,176 @@
+/* 
+Layout benchmark:
+    Dispatches a skewed event mix through a large flat machine whose hot
+    states are scattered across the handle space, then reruns it after
+    sm_optimize_layout has packed them together. Last-level cache misses are
+    read through perf_event_open when the kernel allows it.
+
+States:
+    STATES_LEN states, HOT_LEN of them hot at random handles.
+
+Events:
+    Name      Share
+    ===============
+    Hop       ~97%  (to another hot state)
+    Stray     ~3%   (to a cold state)
+    Spare     never (registered ahead of Hop, so they are scanned first)
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../sm.h"
+
+enum BenchEvent { HOP, STRAY, SPARE_A, SPARE_B };
+
+enum {
+    STATES_LEN = 1 << 17,
+    HOT_LEN    = 1 << 12,
+    EVENTS_LEN = 1 << 22,
+    PCT_STRAY  = 3
+};
+
+static void build(void);
+static void run(const char*);
+static int open_cache_misses(void);
+static SMStateHdl pick(const SMStateHdl*, size_t);
+static SMEventHandlerStatus handler(int, void*);
+static void CHECK(SMStatus);
+
+static SM* sm;
+static SMStateHdl hdls[STATES_LEN];
+static SMStateHdl hot[HOT_LEN];
+static int events[EVENTS_LEN];
+
+int main(void) {
+    srand(1);
+    build();
+
+    for (size_t i = 0; i < EVENTS_LEN; i++) {
+        events[i] = (rand() % 100 < PCT_STRAY) ? STRAY : HOP;
+    }
+
+    run("registration order");
+    CHECK(sm_optimize_layout(sm));
+    run("profile-guided    ");
+
+    sm_destroy(sm);
+
+    return EXIT_SUCCESS;
+}
+
+static void build(void) {
+    CHECK(sm_create(&sm, (SMConfig) {
+        .ignore_unhandled_events = false,
+        .init_states_size        = STATES_LEN + 1,
+        .init_transitions_size   = 4 * STATES_LEN + 1,
+        .profile                 = true
+    }));
+
+    for (size_t i = 0; i < STATES_LEN; i++) {
+        CHECK(sm_register_state(sm, &hdls[i], (SMState) {
+            .handler    = handler,
+            .parent_hdl = SM_NO_PARENT,
+            .on_enter   = NULL,
+            .on_exit    = NULL
+        }));
+    }
+
+    for (size_t i = 0; i < HOT_LEN; i++) {
+        hot[i] = pick(hdls, STATES_LEN);
+    }
+
+    for (size_t i = 0; i < STATES_LEN; i++) {
+        const int on[] = {SPARE_A, SPARE_B, STRAY, HOP};
+
+        for (size_t j = 0; j < sizeof(on) / sizeof(*on); j++) {
+            CHECK(sm_add_transition(sm, (SMTransition) {
+                .from = hdls[i],
+                .on   = on[j],
+                .to   = (on[j] == HOP) ? pick(hot, HOT_LEN) 
+                                       : pick(hdls, STATES_LEN)
+            }));
+        }
+    }
+
+    CHECK(sm_publish(sm, NULL, 0));
+    CHECK(sm_set_state(sm, hot[0]));
+}
+
+static void run(const char* label) {
+    int fd = open_cache_misses();
+    struct timespec start;
+    struct timespec end;
+
+    // Warm up so both runs start from a cache holding the hot set
+    for (size_t i = 0; i < EVENTS_LEN / 4; i++) {
+        CHECK(sm_handle(sm, events[i], NULL));
+    }
+
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t i = 0; i < EVENTS_LEN; i++) {
+        CHECK(sm_handle(sm, events[i], NULL));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 
+        + (end.tv_nsec - start.tv_nsec);
+
+    printf("%s: %6.2f ns/event", label, ns / EVENTS_LEN);
+
+    long long misses;
+
+    if (fd >= 0 && read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+        printf(", %6.3f cache misses/event", (double)misses / EVENTS_LEN);
+    }
+
+    printf("\n");
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static int open_cache_misses(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static SMStateHdl pick(const SMStateHdl* from, size_t len) {
+    return from[((size_t)rand() * RAND_MAX + rand()) % len];
+}
+
+static SMEventHandlerStatus handler(int e, void* args) {
+    return HS_HANDLED;
+}
+
+static void CHECK(SMStatus status) {
+    if (status != SM_OK) {
+        fprintf(stderr, "SM Error: %s\n", sm_status_str(status));
+        exit(1);
+    }
+}
@@ -1,7 +1,7 @@
 /* 
 Keyboard Controls:    
     0 - Turn lights off.
-    1 - Turn lights on.
+    1 - Turn lights on, or resume where they were after an error.
 
 States:
     ON:
@@ -10,6 +10,7 @@ States:
         RED-AMBER
         AMBER
         GREEN
+        H* (deep history)
     OFF
 
 Events:
@@ -25,6 +26,7 @@ Transitions:
     ==============================
     OFF        Turn-On   RED
     ON         Error     ERROR
+    ERROR      Turn-On   H*
     ON         Turn-Off  OFF
     RED        Change    RED-AMBER
     RED-AMBER  Change    GREEN
@@ -91,6 +93,7 @@ static SMStateHdl st_red;
 static SMStateHdl st_red_amber;
 static SMStateHdl st_amber;
 static SMStateHdl st_green;
+static SMStateHdl st_on_history;
 static atomic_bool cycle_lights = false;
 static pthread_t cycle_thread;
 
@@ -99,6 +102,7 @@ int main(int argc, const char** argv) {
     register_states();
     add_transitions();
 
+    CHECK(sm_publish(sm, NULL, 0));
     CHECK(sm_set_state(sm, st_off)); // Initial state
 
     srand(time(NULL));
@@ -220,6 +224,14 @@ static void register_states(void) {
         .on_enter   = enter_green,
         .on_exit    = NULL
     }));
+
+    CHECK(sm_register_state(sm, &st_on_history, (SMState) {
+        .handler    = NULL,
+        .parent_hdl = st_on,
+        .on_enter   = NULL,
+        .on_exit    = NULL,
+        .history    = SM_HISTORY_DEEP
+    }));
 }
 
 void add_transitions(void) {
@@ -241,6 +253,12 @@ void add_transitions(void) {
         .to   = st_error
     }));
 
+    CHECK(sm_add_transition(sm, (SMTransition) {
+        .from = st_error,
+        .on   = TURN_ON,
+        .to   = st_on_history
+    }));
+
     CHECK(sm_add_transition(sm, (SMTransition) {
         .from = st_red,
         .on   = CHANGE,
@@ -336,6 +354,10 @@ static SMEventHandlerStatus off_handler(LightEvent e, void* args) {
 }
 
 static SMEventHandlerStatus error_handler(LightEvent e, void* args) { 
+    if (e == TURN_ON) {
+        start_lights_cycle();
+    }
+
     return HS_HANDLED; 
 }
 
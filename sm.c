@@ -2,22 +2,113 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
 #include <assert.h>
 
 #define GROWTH_SCALE 1.5
-#define ENSURE_CAPACITY(list, size, n) {        \
-    void* buff = list;                          \
-    size *= GROWTH_SCALE;                       \
-    buff = realloc(list, sizeof(*list) * size); \
-                                                \
-    if (buff == NULL) {                         \
-        free(list);                             \
-        return SM_ERROR;                        \
-    }                                           \
-                                                \
-    list = buff;                                \
+#define ENSURE_CAPACITY(list, size, n) if ((n) >= (size)) { \
+    void* buff = list;                                      \
+    size = size * GROWTH_SCALE + 1;                         \
+    buff = realloc(list, sizeof(*list) * size);             \
+                                                            \
+    if (buff == NULL) {                                     \
+        free(list);                                         \
+        return SM_ERROR;                                    \
+    }                                                       \
+                                                            \
+    list = buff;                                            \
 }
 
+#define BLOCK_ALIGN _Alignof(max_align_t)
+#define BLOCK_SIZE(size) (((size) + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1))
+
+/* The machine's state is a single word tagging the current handle with the
+ * version it belongs to, so a handle left over from an older version is never
+ * mistaken for one of the current version. The tag is derived from the
+ * definition id, so it means the same in every process; 0 means no version. */
+#define STATE_WORD(tag, hdl) (((unsigned long long)(tag) << 32) | (hdl))
+#define WORD_TAG(word) ((unsigned)((word) >> 32))
+#define WORD_HDL(word) ((SMStateHdl)((word) & 0xFFFFFFFFu))
+#define ID_TAG(id) ((unsigned)((id) ^ ((id) >> 32)) ? \
+                    (unsigned)((id) ^ ((id) >> 32)) : 1u)
+
+/* How many earlier versions a published one remembers tags of. */
+#define DEF_TAGS 8
+
+#define NO_HISTORY_SLOT ((unsigned)-1)
+
+typedef struct SMDef SMDef;
+typedef struct SMEdge SMEdge;
+typedef struct SMRank SMRank;
+typedef struct SMRaisedEvent SMRaisedEvent;
+typedef struct SMInstance SMInstance;
+typedef struct SMTransitionKey SMTransitionKey;
+
+struct SMEdge {
+    int on;
+    SMStateHdl to;
+    unsigned src;
+};
+
+/* A published version. States are laid out in `order`, which maps these
+ * internal handles back to the ones callers registered, and each state's
+ * transitions sit together in `edges[edges_first[hdl]..edges_first[hdl + 1])`.
+ * A state's ancestors, outermost first and ending with itself, are likewise
+ * precomputed in `paths[paths_first[hdl]..paths_first[hdl + 1])`.
+ * Everything inside refers to internal handles; the machine's state word,
+ * history and the migration map keep using the caller's.
+ * `same_tags` are the versions (this one included) whose handles mean the same
+ * as this one's, and `migrate` translates handles of the `source_tags` ones. */
+struct SMDef {
+    unsigned long long id;
+    unsigned tag;
+    unsigned same_tags[DEF_TAGS];
+    size_t same_tags_len;
+    unsigned source_tags[DEF_TAGS];
+    size_t source_tags_len;
+    SMState* states;
+    size_t states_len;
+    SMStateHdl* order;
+    SMStateHdl* rank;
+    size_t* edges_first;
+    SMEdge* edges;
+    size_t edges_len;
+    size_t* paths_first;
+    SMStateHdl* paths;
+    unsigned* history_slot;
+    atomic_ulong* state_hits;
+    atomic_ulong* edge_hits;
+    SMStateHdl* migrate;
+    size_t migrate_len;
+};
+
+struct SMTransitionKey {
+    SMStateHdl from;
+    int on;
+    size_t src;
+};
+
+struct SMRank {
+    unsigned long score;
+    SMStateHdl hdl;
+};
+
+struct SMRaisedEvent {
+    int e;
+    void* args;
+};
+
+/* Everything that changes as the machine runs, kept free of pointers so it
+ * can live in memory shared between processes. */
+struct SMInstance {
+    atomic_ullong state;
+    atomic_ullong seq;
+    atomic_uint shallow[SM_HISTORY_SLOTS];
+    atomic_uint deep[SM_HISTORY_SLOTS];
+};
+
 struct SM {
     SMState* states;
     size_t states_size;
@@ -25,20 +116,77 @@ struct SM {
     SMTransition* transitions;
     size_t transitions_size;
     size_t transitions_len;
-    SMStateHdl state_hdl;
+    _Atomic(SMDef*) def;
+    atomic_uint epoch;
+    atomic_size_t readers[2];
+    atomic_flag publishing;
+    SMInstance own;
+    _Atomic(SMInstance*) inst;
+    SMInstance* running;
+    _Atomic(const void*) dispatcher;
+    SMObserver observer;
+    void* observer_ctx;
+    void* context;
+    SMRaisedEvent raised[SM_RAISE_QUEUE_SIZE];
+    unsigned raised_head;
+    unsigned raised_len;
+    bool draft_changed;
     bool ignore_unhandled_events;
+    bool profile;
 };
 
+static SMStatus publish(SM*, const SMStateHdl*, size_t, const SMStateHdl*, 
+                        const unsigned long*);
+static SMDef* create_def(SM*, const SMStateHdl*, size_t, const SMStateHdl*, 
+                         const unsigned long*);
+static int compare_rank(const void*, const void*);
+static unsigned long long definition_id(SM*, const SMStateHdl*, size_t);
+static unsigned long long hash_word(unsigned long long, unsigned long long);
+static void chain_tags(SMDef*, const SMDef*, bool);
+static void add_tag(unsigned*, size_t*, unsigned);
+static bool has_tag(const unsigned*, size_t, unsigned);
+static SMStatus verify_states(SM*, SMReport*, unsigned char*);
+static SMStatus verify_transitions(SM*, SMReport*, unsigned char*, 
+                                   SMTransitionKey*);
+static void find_unreachable(SM*, SMReport*, unsigned char*);
+static SMStatus report_defect(SMReport*, SMDefect, SMStateHdl, size_t, 
+                              SMStatus);
+static int compare_transition_key(const void*, const void*);
+static SMDef* acquire_def(SM*, unsigned*);
+static SMStatus acquire_published(SM*, SMDef**, unsigned*);
+static void release_def(SM*, unsigned);
+static SMStateHdl sync_state(SM*, SMInstance*, SMDef*);
+static SMStateHdl migrate_hdl(SMDef*, unsigned long long);
+static SMStatus begin_dispatch(SM*, SMInstance*, bool*);
+static SMStatus end_dispatch(SM*, SMStatus);
+static SMStatus dispatch_event(SM*, int, void*);
+static SMStatus handle(SM*, SMDef*, int, void*);
+static SMStatus transition(SM*, SMDef*, SMStateHdl, SMStateHdl);
+static SMStateHdl resolve_history(SM*, SMDef*, SMStateHdl);
+static void clear_history(SMInstance*);
+static bool begin_transition(SM*);
+static void end_transition(SM*);
 static bool valid_transition(SM*, SMTransition*);
-static bool valid_state_hdl(SM*, SMStateHdl);
+static bool valid_state_hdl(size_t, SMStateHdl);
 static SMEventHandlerStatus dummy_handler(int, void*);
 static int dummy_on_enter(void);
 static int dummy_on_exit(void);
-static int enter_state(SM*, SMStateHdl);
-static int exit_state(SM*, SMStateHdl);
-static size_t ancestor_count(SM*, SMStateHdl);
-static SMState* get_ancestor(SM*, SMStateHdl, size_t);
-static SMTransition* lookup_trans(SM*, SMStateHdl, int);
+static int enter_state(SM*, SMDef*, SMStateHdl);
+static int exit_state(SM*, SMDef*, SMStateHdl);
+static size_t draft_depth(SM*, SMStateHdl);
+static SMEdge* lookup_trans(SMDef*, SMStateHdl, int);
+
+/* Only its address is used: it tells the dispatching thread of an SM apart. */
+static _Thread_local char dispatch_thread;
+
+enum { DUMMY_STATE_HDL = 0 };
+
+/* Bits of the per-state marks used while verifying */
+enum { 
+    MARK_ROOTED   = 1 << 0, 
+    MARK_HISTORY  = 1 << 1, 
+    MARK_ENTERED  = 1 << 2 
+};
 
 SMStatus sm_create(SM** out, SMConfig cfg) {
     SM* sm = malloc(sizeof(*sm));
@@ -47,14 +195,26 @@ SMStatus sm_create(SM** out, SMConfig cfg) {
         return SM_ERROR;
     }
 
-    enum { DUMMY_STATE_HDL = 0 };
-
     sm->ignore_unhandled_events = cfg.ignore_unhandled_events;
+    sm->profile = cfg.profile;
     sm->states_size = cfg.init_states_size;
     sm->states_len = 0;
     sm->transitions_size = cfg.init_transitions_size;
     sm->transitions_len = 0;
-    sm->state_hdl = DUMMY_STATE_HDL;
+    atomic_init(&sm->def, NULL);
+    atomic_init(&sm->epoch, 0);
+    atomic_init(&sm->readers[0], 0);
+    atomic_init(&sm->readers[1], 0);
+    atomic_flag_clear(&sm->publishing);
+    sm_instance_init(&sm->own);
+    atomic_init(&sm->inst, &sm->own);
+    sm->running = &sm->own;
+    sm->observer = NULL;
+    sm->observer_ctx = NULL;
+    sm->context = NULL;
+    sm->raised_head = 0;
+    sm->raised_len = 0;
+    atomic_init(&sm->dispatcher, NULL);
     sm->states = malloc(sizeof(*sm->states) * sm->states_size);
 
     if (!sm->states) {
@@ -97,11 +257,13 @@ void sm_destroy(SM* sm) {
         sm->transitions = NULL;
     }
 
+    free(atomic_exchange(&sm->def, NULL));
+
     sm->states_size = 0;
     sm->states_len = 0;
     sm->transitions_size = 0;
     sm->transitions_len = 0;
-    sm->state_hdl = 0;
+    sm_instance_init(&sm->own);
 
     free(sm);
 }
@@ -119,51 +281,99 @@ SMStatus sm_register_state(SM* sm, SMStateHdl* hdl, SMState state) {
 
     sm->states[sm->states_len] = state;
     *hdl = sm->states_len++;
+    sm->draft_changed = true;
 
     return SM_OK;
 }
 
 SMStatus sm_handle(SM* sm, int e, void* args) {
-    SMState* s = &sm->states[sm->state_hdl];
-    bool handled = false;
+    return sm_handle_instance(sm, NULL, e, args);
+}
 
-    while (true) {        
-        SMEventHandlerStatus status = s->handler(e, args);
-        
-        if (status == HS_ERROR) {
-            return SM_ERROR;
-        }
+SMStatus sm_handle_instance(SM* sm, void* storage, int e, void* args) {
+    bool outermost;
+    SMStatus status = begin_dispatch(sm, storage, &outermost);
 
-        handled = status == HS_HANDLED;
+    if (status != SM_OK) {
+        return status;
+    }
 
-        if (handled || s->parent_hdl == SM_NO_PARENT) {
-            break;
-        }
+    status = dispatch_event(sm, e, args);
 
-        s = &sm->states[s->parent_hdl];
+    return outermost ? end_dispatch(sm, status) : status;
+}
+
+SMStatus sm_raise(SM* sm, int e, void* args) {
+    if (atomic_load_explicit(&sm->dispatcher, memory_order_relaxed) 
+        != &dispatch_thread) {
+        return sm_handle(sm, e, args);
     }
 
-    if (!(handled || sm->ignore_unhandled_events)) {
-        return SM_UNHANDLED_EVENT;
+    if (sm->raised_len == SM_RAISE_QUEUE_SIZE) {
+        return SM_QUEUE_FULL;
     }
 
-    SMTransition* trans = lookup_trans(sm, sm->state_hdl, e);
+    unsigned tail = (sm->raised_head + sm->raised_len) % SM_RAISE_QUEUE_SIZE;
+    sm->raised[tail] = (SMRaisedEvent) {.e = e, .args = args};
+    sm->raised_len++;
 
-    return trans ? sm_set_state(sm, trans->to) : SM_OK;
+    return SM_OK;
 }
 
 SMStatus sm_set_state(SM* sm, SMStateHdl hdl) {
-    if (!valid_state_hdl(sm, hdl)) {
-        return SM_INVALID_STATE;
+    return sm_set_state_instance(sm, NULL, hdl);
+}
+
+SMStatus sm_set_state_instance(SM* sm, void* storage, SMStateHdl hdl) {
+    bool outermost;
+    SMStatus status = begin_dispatch(sm, storage, &outermost);
+
+    if (status != SM_OK) {
+        return status;
     }
 
-    if (exit_state(sm, sm->state_hdl)) {
-        return SM_ERROR;
+    unsigned epoch;
+    SMDef* def;
+    status = acquire_published(sm, &def, &epoch);
+
+    if (status != SM_OK) {
+        return outermost ? end_dispatch(sm, status) : status;
+    }
+
+    if (valid_state_hdl(def->states_len, hdl)) {
+        SMStateHdl from = def->rank[sync_state(sm, sm->running, def)];
+        status = transition(sm, def, from, def->rank[hdl]);
+    } else {
+        status = SM_INVALID_STATE;
+    }
+
+    release_def(sm, epoch);
+
+    return outermost ? end_dispatch(sm, status) : status;
+}
+
+SMStatus sm_set_state_unchecked(SM* sm, SMStateHdl hdl) {
+    bool outermost;
+    SMStatus status = begin_dispatch(sm, NULL, &outermost);
+
+    if (status != SM_OK) {
+        return status;
     }
 
-    sm->state_hdl = hdl;
+    unsigned epoch;
+    SMDef* def;
+    status = acquire_published(sm, &def, &epoch);
 
-    return enter_state(sm, hdl) ? SM_ERROR : SM_OK;
+    if (status != SM_OK) {
+        return outermost ? end_dispatch(sm, status) : status;
+    }
+
+    SMStateHdl from = def->rank[sync_state(sm, sm->running, def)];
+    status = transition(sm, def, from, def->rank[hdl]);
+
+    release_def(sm, epoch);
+
+    return outermost ? end_dispatch(sm, status) : status;
 }
 
 SMStatus sm_add_transition(SM* sm, SMTransition trans) {
@@ -174,100 +384,1084 @@ SMStatus sm_add_transition(SM* sm, SMTransition trans) {
     ENSURE_CAPACITY(sm->transitions, sm->transitions_size, sm->transitions_len)
 
     sm->transitions[sm->transitions_len++] = trans;
+    sm->draft_changed = true;
+
+    return SM_OK;
+}
+
+SMStatus sm_verify(SM* sm, SMReport* report) {
+    SMReport unused;
+    SMReport* r = report ? report : &unused;
+    unsigned char* marks = calloc(sm->states_len, sizeof(*marks));
+    SMTransitionKey* keys = malloc(sizeof(*keys) * (sm->transitions_len + 1));
+
+    *r = (SMReport) {.defect = SM_DEFECT_NONE, .state = SM_NO_PARENT, 
+        .transition = 0, .unreachable = 0, .first_unreachable = SM_NO_PARENT};
+
+    if (!(marks && keys)) {
+        free(marks);
+        free(keys);
+
+        return SM_ERROR;
+    }
+
+    SMStatus status = verify_states(sm, r, marks);
+
+    if (status == SM_OK) {
+        status = verify_transitions(sm, r, marks, keys);
+    }
+
+    if (status == SM_OK) {
+        find_unreachable(sm, r, marks);
+    }
+
+    free(marks);
+    free(keys);
+
+    return status;
+}
+
+SMStatus sm_publish(SM* sm, const SMStateHdl* migrate, size_t migrate_len) {
+    return publish(sm, migrate, migrate_len, NULL, NULL);
+}
+
+SMStatus sm_optimize_layout(SM* sm) {
+    unsigned epoch;
+    SMDef* def = acquire_def(sm, &epoch);
+
+    if (def == NULL || def->state_hits == NULL) {
+        release_def(sm, epoch);
+
+        return SM_ERROR;
+    }
+
+    // The new layout is built from the draft, so it has to be what is published
+    if (sm->draft_changed) {
+        release_def(sm, epoch);
+
+        return SM_BUSY;
+    }
+
+    SMRank* ranks = calloc(sm->states_len, sizeof(*ranks));
+    SMStateHdl* order = malloc(sizeof(*order) * sm->states_len);
+    unsigned long* edge_hits = calloc(sm->transitions_len + 1, 
+                                      sizeof(*edge_hits));
+
+    if (!(ranks && order && edge_hits)) {
+        release_def(sm, epoch);
+        free(ranks);
+        free(order);
+        free(edge_hits);
+
+        return SM_ERROR;
+    }
+
+    for (size_t i = 0; i < sm->states_len; i++) {
+        ranks[i].hdl = i;
+    }
+
+    // Events bubble up to ancestors, so a state is as hot as its descendants
+    for (size_t i = 0; i < def->states_len; i++) {
+        unsigned long hits = atomic_load_explicit(&def->state_hits[i], 
+                                                  memory_order_relaxed);
+        SMStateHdl hdl = def->order[i];
+
+        while (hits && hdl < sm->states_len) {
+            ranks[hdl].score += hits;
+
+            if (sm->states[hdl].parent_hdl == SM_NO_PARENT) {
+                break;
+            }
+
+            hdl = sm->states[hdl].parent_hdl;
+        }
+    }
+
+    for (size_t i = 0; i < def->edges_len; i++) {
+        SMEdge* edge = &def->edges[i];
+
+        if (edge->src < sm->transitions_len) {
+            edge_hits[edge->src] = atomic_load_explicit(&def->edge_hits[i], 
+                                                        memory_order_relaxed);
+        }
+    }
+
+    release_def(sm, epoch);
+
+    // The dummy state keeps handle 0, which also stands for "no parent"
+    ranks[DUMMY_STATE_HDL].score = (unsigned long)-1;
+    qsort(ranks, sm->states_len, sizeof(*ranks), &compare_rank);
+
+    for (size_t i = 0; i < sm->states_len; i++) {
+        order[i] = ranks[i].hdl;
+    }
+
+    SMStatus status = publish(sm, NULL, 0, order, edge_hits);
+
+    free(ranks);
+    free(order);
+    free(edge_hits);
+
+    return status;
+}
+
+SMStatus sm_definition_id(SM* sm, unsigned long long* id) {
+    unsigned epoch;
+    SMDef* def;
+    SMStatus status = acquire_published(sm, &def, &epoch);
+
+    if (status != SM_OK) {
+        return status;
+    }
+
+    *id = def->id;
+    release_def(sm, epoch);
 
     return SM_OK;
 }
 
+SMStatus sm_definition_follows(SM* sm, unsigned long long id, bool* follows) {
+    unsigned epoch;
+    SMDef* def;
+    SMStatus status = acquire_published(sm, &def, &epoch);
+
+    if (status != SM_OK) {
+        return status;
+    }
+
+    *follows = has_tag(def->same_tags, def->same_tags_len, ID_TAG(id)) 
+        || has_tag(def->source_tags, def->source_tags_len, ID_TAG(id));
+    release_def(sm, epoch);
+
+    return SM_OK;
+}
+
+SMStatus sm_translate_states(SM* sm, unsigned* version, SMStateHdl* hdls, 
+                             size_t len) {
+    unsigned epoch;
+    SMDef* def;
+    SMStatus status = acquire_published(sm, &def, &epoch);
+
+    if (status != SM_OK) {
+        return status;
+    }
+
+    // All against the one version, even if another is published meanwhile
+    for (size_t i = 0; i < len; i++) {
+        hdls[i] = migrate_hdl(def, STATE_WORD(*version, hdls[i]));
+    }
+
+    *version = def->tag;
+    release_def(sm, epoch);
+
+    return SM_OK;
+}
+
+SMStateHdl sm_current_state(const SM* sm) {
+    SMInstance* inst = atomic_load_explicit(&sm->inst, memory_order_acquire);
+
+    return WORD_HDL(atomic_load_explicit(&inst->state, memory_order_acquire));
+}
+
+void sm_snapshot(const SM* sm, SMSnapshot* out) {
+    sm_instance_snapshot(atomic_load_explicit(&sm->inst, memory_order_acquire),
+                         out);
+}
+
+size_t sm_instance_size(void) {
+    return sizeof(SMInstance);
+}
+
+void sm_instance_init(void* storage) {
+    SMInstance* inst = storage;
+
+    atomic_init(&inst->state, STATE_WORD(0, DUMMY_STATE_HDL));
+    atomic_init(&inst->seq, 0);
+
+    for (size_t i = 0; i < SM_HISTORY_SLOTS; i++) {
+        atomic_init(&inst->shallow[i], DUMMY_STATE_HDL);
+        atomic_init(&inst->deep[i], DUMMY_STATE_HDL);
+    }
+}
+
+void sm_instance_recover(void* storage) {
+    SMInstance* inst = storage;
+    unsigned long long seq = atomic_load(&inst->seq);
+
+    // The state word is always whole; only the transition marker can be left
+    // open by a dispatcher that died mid-transition.
+    if (seq & 1) {
+        atomic_store(&inst->seq, seq + 1);
+    }
+}
+
+void sm_instance_snapshot(const void* storage, SMSnapshot* out) {
+    const SMInstance* inst = storage;
+    unsigned long long seq;
+    unsigned long long word;
+
+    // Seqlock read: retry only if a transition began or ended meanwhile
+    do {
+        seq = atomic_load_explicit(&inst->seq, memory_order_acquire);
+        word = atomic_load_explicit(&inst->state, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while (seq != atomic_load_explicit(&inst->seq, memory_order_relaxed));
+
+    out->state = WORD_HDL(word);
+    out->version = WORD_TAG(word);
+    out->transitions = seq >> 1;
+    out->in_transition = seq & 1;
+}
+
+void sm_set_context(SM* sm, void* context) {
+    sm->context = context;
+}
+
+void sm_set_observer(SM* sm, SMObserver observer, void* ctx) {
+    sm->observer = observer;
+    sm->observer_ctx = ctx;
+}
+
+SMStatus sm_state_parent(SM* sm, SMStateHdl hdl, SMStateHdl* parent) {
+    unsigned epoch;
+    SMDef* def = acquire_def(sm, &epoch);
+    SMStatus status = SM_INVALID_STATE;
+
+    if (def && hdl < def->states_len) {
+        *parent = def->order[def->states[def->rank[hdl]].parent_hdl];
+        status = SM_OK;
+    }
+
+    release_def(sm, epoch);
+
+    return status;
+}
+
+void sm_bind_instance(SM* sm, void* storage) {
+    atomic_store_explicit(&sm->inst, storage ? storage : &sm->own, 
+                          memory_order_release);
+}
+
+void sm_reset_definition(SM* sm) {
+    sm->states_len = DUMMY_STATE_HDL + 1;
+    sm->transitions_len = 0;
+    sm->draft_changed = true;
+}
+
 const char* sm_status_str(SMStatus status) {
     switch (status) {
-        case SM_ERROR:              return "Error";
-        case SM_INVALID_TRANSITION: return "Invalid Transition";
-        case SM_INVALID_STATE:      return "Invalid State";
-        case SM_UNHANDLED_EVENT:    return "Unhandled Event";
-        case SM_OK:                 return "OK";
+        case SM_ERROR:               return "Error";
+        case SM_INVALID_TRANSITION:  return "Invalid Transition";
+        case SM_INVALID_STATE:       return "Invalid State";
+        case SM_UNHANDLED_EVENT:     return "Unhandled Event";
+        case SM_QUEUE_FULL:          return "Queue Full";
+        case SM_BUSY:                return "Busy";
+        case SM_UNKNOWN_KEY:         return "Unknown Key";
+        case SM_DEFINITION_MISMATCH: return "Definition Mismatch";
+        case SM_OK:                  return "OK";
         default: assert(0); // Unknown status
     }
 }
 
-static int enter_state(SM* sm, SMStateHdl state_hdl) {
-    for (int i = ancestor_count(sm, state_hdl); i > 0; i--) {
-        int status = get_ancestor(sm, state_hdl, i)->on_enter();
+static SMStatus publish(SM* sm, const SMStateHdl* migrate, size_t migrate_len,
+                        const SMStateHdl* order, const unsigned long* edge_hits) {
+    for (size_t i = 0; i < migrate_len; i++) {
+        if (migrate[i] >= sm->states_len) {
+            return SM_INVALID_STATE;
+        }
+    }
 
-        if (status) {
+    // Everything the hot path relies on is checked once, here
+    SMStatus status = sm_verify(sm, NULL);
+
+    if (status != SM_OK) {
+        return status;
+    }
+
+    while (atomic_flag_test_and_set(&sm->publishing)) {
+        // Publishers are rare; spin until the one in progress is done
+    }
+
+    // A version that keeps handles as they are keeps translating those of the
+    // versions before the last migration too, for instances still on them
+    SMDef* old = atomic_load(&sm->def);
+    bool migrating = migrate != NULL;
+
+    if (!migrating && old) {
+        migrate = old->migrate;
+        migrate_len = old->migrate_len;
+    }
+
+    SMDef* def = create_def(sm, migrate, migrate_len, order, edge_hits);
+
+    if (def == NULL) {
+        atomic_flag_clear(&sm->publishing);
+
+        return SM_ERROR;
+    }
+
+    def->id = definition_id(sm, migrate, migrate_len);
+    def->tag = ID_TAG(def->id);
+    chain_tags(def, old, migrating);
+    atomic_store(&sm->def, def);
+    sm->draft_changed = false;
+
+    // Readers that pinned the old epoch may still be using the old version;
+    // readers arriving from now on pin the new epoch and see the new version.
+    unsigned epoch = atomic_fetch_add(&sm->epoch, 1);
+
+    while (atomic_load(&sm->readers[epoch & 1])) {
+        // Wait for dispatch in flight on the old version to finish
+    }
+
+    // The instance moves over lazily, on the thread that next dispatches it:
+    // migrating here would race that thread's history and observer
+    atomic_flag_clear(&sm->publishing);
+    free(old);
+
+    return SM_OK;
+}
+
+static SMDef* create_def(SM* sm, const SMStateHdl* migrate, size_t migrate_len,
+                         const SMStateHdl* order, 
+                         const unsigned long* edge_hits) {
+    size_t states_len = sm->states_len;
+    size_t edges_len = sm->transitions_len;
+    size_t states_size = sizeof(SMState) * states_len;
+    size_t hdls_size = sizeof(SMStateHdl) * states_len;
+    size_t first_size = sizeof(size_t) * (states_len + 1);
+    size_t edges_size = sizeof(SMEdge) * edges_len;
+    size_t paths_len = 0;
+
+    for (size_t i = 0; i < states_len; i++) {
+        paths_len += draft_depth(sm, i) + 1;
+    }
+
+    size_t paths_size = sizeof(SMStateHdl) * paths_len;
+    size_t slots_size = sizeof(unsigned) * states_len;
+    size_t state_hits_size = sm->profile ? sizeof(atomic_ulong) * states_len : 0;
+    size_t edge_hits_size = sm->profile ? sizeof(atomic_ulong) * edges_len : 0;
+    size_t migrate_size = sizeof(SMStateHdl) * migrate_len;
+
+    // One block per version, so reclaiming a version is a single free
+    char* block = malloc(BLOCK_SIZE(sizeof(SMDef)) + BLOCK_SIZE(states_size)
+        + 2 * BLOCK_SIZE(hdls_size) + 2 * BLOCK_SIZE(first_size) 
+        + BLOCK_SIZE(edges_size) + BLOCK_SIZE(paths_size) 
+        + BLOCK_SIZE(slots_size) + BLOCK_SIZE(state_hits_size) 
+        + BLOCK_SIZE(edge_hits_size) + BLOCK_SIZE(migrate_size));
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    SMDef* def = (SMDef*)block;
+    block += BLOCK_SIZE(sizeof(SMDef));
+    def->states = (SMState*)block;
+    block += BLOCK_SIZE(states_size);
+    def->order = (SMStateHdl*)block;
+    block += BLOCK_SIZE(hdls_size);
+    def->rank = (SMStateHdl*)block;
+    block += BLOCK_SIZE(hdls_size);
+    def->edges_first = (size_t*)block;
+    block += BLOCK_SIZE(first_size);
+    def->edges = (SMEdge*)block;
+    block += BLOCK_SIZE(edges_size);
+    def->paths_first = (size_t*)block;
+    block += BLOCK_SIZE(first_size);
+    def->paths = (SMStateHdl*)block;
+    block += BLOCK_SIZE(paths_size);
+    def->history_slot = (unsigned*)block;
+    block += BLOCK_SIZE(slots_size);
+    def->state_hits = sm->profile ? (atomic_ulong*)block : NULL;
+    block += BLOCK_SIZE(state_hits_size);
+    def->edge_hits = sm->profile ? (atomic_ulong*)block : NULL;
+    block += BLOCK_SIZE(edge_hits_size);
+    def->migrate = migrate ? (SMStateHdl*)block : NULL;
+
+    def->states_len = states_len;
+    def->edges_len = edges_len;
+    def->migrate_len = migrate ? migrate_len : 0;
+
+    for (size_t i = 0; i < states_len; i++) {
+        def->order[i] = order ? order[i] : i;
+        def->rank[def->order[i]] = i;
+    }
+
+    for (size_t i = 0; i < states_len; i++) {
+        def->states[i] = sm->states[def->order[i]];
+        def->states[i].parent_hdl = def->rank[def->states[i].parent_hdl];
+    }
+
+    size_t next_path = 0;
+
+    for (size_t i = 0; i < states_len; i++) {
+        size_t len = draft_depth(sm, def->order[i]) + 1;
+        SMStateHdl hdl = i;
+
+        def->paths_first[i] = next_path;
+        next_path += len;
+
+        for (size_t j = next_path; j > def->paths_first[i]; j--) {
+            def->paths[j - 1] = hdl;
+            hdl = def->states[hdl].parent_hdl;
+        }
+
+        def->history_slot[i] = NO_HISTORY_SLOT;
+    }
+
+    def->paths_first[states_len] = next_path;
+
+    unsigned history_slots = 0;
+
+    for (size_t i = 0; i < states_len; i++) {
+        unsigned* slot = &def->history_slot[def->states[i].parent_hdl];
+
+        if (def->states[i].history != SM_HISTORY_NONE 
+            && *slot == NO_HISTORY_SLOT) {
+            *slot = history_slots++;
+        }
+    }
+
+    // Bucket the transitions by source state, keeping registration order
+    memset(def->edges_first, 0, first_size);
+
+    for (size_t i = 0; i < edges_len; i++) {
+        def->edges_first[def->rank[sm->transitions[i].from] + 1]++;
+    }
+
+    for (size_t i = 0; i < states_len; i++) {
+        def->edges_first[i + 1] += def->edges_first[i];
+    }
+
+    for (size_t i = 0; i < edges_len; i++) {
+        SMTransition* trans = &sm->transitions[i];
+        size_t* next = &def->edges_first[def->rank[trans->from]];
+
+        def->edges[(*next)++] = (SMEdge) {
+            .on = trans->on, .to = def->rank[trans->to], .src = i};
+    }
+
+    for (size_t i = states_len; i > 0; i--) {
+        def->edges_first[i] = def->edges_first[i - 1];
+    }
+
+    def->edges_first[0] = 0;
+
+    // Within a state the most used transitions are found first. Ties keep
+    // registration order so the first matching transition still wins.
+    for (size_t i = 0; edge_hits && i < states_len; i++) {
+        for (size_t j = def->edges_first[i] + 1; j < def->edges_first[i + 1]; 
+             j++) {
+            SMEdge edge = def->edges[j];
+            size_t k = j;
+
+            for (; k > def->edges_first[i] 
+                   && edge_hits[def->edges[k - 1].src] < edge_hits[edge.src]; 
+                 k--) {
+                def->edges[k] = def->edges[k - 1];
+            }
+
+            def->edges[k] = edge;
+        }
+    }
+
+    for (size_t i = 0; def->state_hits && i < states_len; i++) {
+        atomic_init(&def->state_hits[i], 0);
+    }
+
+    for (size_t i = 0; def->edge_hits && i < edges_len; i++) {
+        atomic_init(&def->edge_hits[i], 0);
+    }
+
+    if (migrate) {
+        memcpy(def->migrate, migrate, migrate_size);
+    }
+
+    return def;
+}
+
+static SMStatus verify_states(SM* sm, SMReport* r, unsigned char* marks) {
+    size_t n = sm->states_len;
+    size_t history_slots = 0;
+
+    for (size_t i = DUMMY_STATE_HDL + 1; i < n; i++) {
+        SMState* s = &sm->states[i];
+
+        if (s->parent_hdl >= n) {
+            return report_defect(r, SM_DEFECT_DANGLING_PARENT, i, 0, 
+                                 SM_INVALID_STATE);
+        }
+
+        if (s->history == SM_HISTORY_NONE 
+            && s->handler == NULL && s->ctx_handler == NULL) {
+            return report_defect(r, SM_DEFECT_NO_HANDLER, i, 0, 
+                                 SM_INVALID_STATE);
+        }
+
+        // History is a target only: it needs a composite and has no substates
+        if ((s->history != SM_HISTORY_NONE && s->parent_hdl == SM_NO_PARENT)
+            || sm->states[s->parent_hdl].history != SM_HISTORY_NONE) {
+            return report_defect(r, SM_DEFECT_BAD_HISTORY, i, 0, 
+                                 SM_INVALID_STATE);
+        }
+    }
+
+    for (size_t i = DUMMY_STATE_HDL + 1; i < n; i++) {
+        SMStateHdl hdl = i;
+        size_t steps = 0;
+
+        // Stop at the root or at a state already known to reach it
+        while (hdl != SM_NO_PARENT && !(marks[hdl] & MARK_ROOTED)) {
+            if (++steps > n) {
+                return report_defect(r, SM_DEFECT_PARENT_CYCLE, i, 0, 
+                                     SM_INVALID_STATE);
+            }
+
+            hdl = sm->states[hdl].parent_hdl;
+        }
+
+        for (hdl = i; hdl != SM_NO_PARENT && !(marks[hdl] & MARK_ROOTED); 
+             hdl = sm->states[hdl].parent_hdl) {
+            marks[hdl] |= MARK_ROOTED;
+        }
+
+        SMStateHdl parent = sm->states[i].parent_hdl;
+
+        if (sm->states[i].history != SM_HISTORY_NONE 
+            && !(marks[parent] & MARK_HISTORY)) {
+            marks[parent] |= MARK_HISTORY;
+
+            if (++history_slots > SM_HISTORY_SLOTS) {
+                return report_defect(r, SM_DEFECT_TOO_MANY_HISTORIES, i, 0, 
+                                     SM_INVALID_STATE);
+            }
+        }
+    }
+
+    return SM_OK;
+}
+
+static SMStatus verify_transitions(SM* sm, SMReport* r, unsigned char* marks,
+                                   SMTransitionKey* keys) {
+    size_t n = sm->states_len;
+
+    for (size_t i = 0; i < sm->transitions_len; i++) {
+        SMTransition* trans = &sm->transitions[i];
+
+        if (trans->from >= n || trans->to >= n) {
+            return report_defect(r, SM_DEFECT_DANGLING_TRANSITION, 
+                                 (trans->from >= n) ? trans->from : trans->to,
+                                 i, SM_INVALID_TRANSITION);
+        }
+
+        // A history state is never current, so nothing can leave it
+        if (sm->states[trans->from].history != SM_HISTORY_NONE) {
+            return report_defect(r, SM_DEFECT_BAD_HISTORY, trans->from, i, 
+                                 SM_INVALID_TRANSITION);
+        }
+
+        keys[i] = (SMTransitionKey) {
+            .from = trans->from, .on = trans->on, .src = i};
+
+        // Entering a state enters its ancestors; history enters its composite
+        SMStateHdl hdl = trans->to;
+
+        if (sm->states[hdl].history != SM_HISTORY_NONE) {
+            hdl = sm->states[hdl].parent_hdl;
+        }
+
+        for (; hdl != SM_NO_PARENT; hdl = sm->states[hdl].parent_hdl) {
+            marks[hdl] |= MARK_ENTERED;
+        }
+    }
+
+    qsort(keys, sm->transitions_len, sizeof(*keys), &compare_transition_key);
+
+    for (size_t i = 1; i < sm->transitions_len; i++) {
+        SMTransitionKey* prev = &keys[i - 1];
+        SMTransitionKey* key = &keys[i];
+
+        if (prev->from == key->from && prev->on == key->on 
+            && sm->transitions[prev->src].to != sm->transitions[key->src].to) {
+            return report_defect(r, SM_DEFECT_CONFLICTING_TRANSITIONS, 
+                                 key->from, key->src, SM_INVALID_TRANSITION);
+        }
+    }
+
+    return SM_OK;
+}
+
+static void find_unreachable(SM* sm, SMReport* r, unsigned char* marks) {
+    for (size_t i = DUMMY_STATE_HDL + 1; i < sm->states_len; i++) {
+        if (sm->states[i].history == SM_HISTORY_NONE 
+            && !(marks[i] & MARK_ENTERED)) {
+            if (r->unreachable++ == 0) {
+                r->first_unreachable = i;
+            }
+        }
+    }
+}
+
+static SMStatus report_defect(SMReport* r, SMDefect defect, SMStateHdl hdl, 
+                              size_t trans, SMStatus status) {
+    r->defect = defect;
+    r->state = hdl;
+    r->transition = trans;
+
+    return status;
+}
+
+static int compare_transition_key(const void* a, const void* b) {
+    const SMTransitionKey* x = a;
+    const SMTransitionKey* y = b;
+
+    if (x->from != y->from) {
+        return (x->from > y->from) - (x->from < y->from);
+    }
+
+    if (x->on != y->on) {
+        return (x->on > y->on) - (x->on < y->on);
+    }
+
+    return (x->src > y->src) - (x->src < y->src);
+}
+
+static unsigned long long definition_id(SM* sm, const SMStateHdl* migrate, 
+                                        size_t migrate_len) {
+    // FNV-1a over everything handles mean, but not the callbacks, whose
+    // addresses differ between processes, nor how many times it was
+    // published, so only a different definition or migration changes it
+    unsigned long long id = hash_word(0xcbf29ce484222325ull, sm->states_len);
+
+    for (size_t i = 0; i < sm->states_len; i++) {
+        id = hash_word(id, sm->states[i].parent_hdl);
+        id = hash_word(id, sm->states[i].history);
+    }
+
+    id = hash_word(id, sm->transitions_len);
+
+    for (size_t i = 0; i < sm->transitions_len; i++) {
+        id = hash_word(id, sm->transitions[i].from);
+        id = hash_word(id, (unsigned)sm->transitions[i].on);
+        id = hash_word(id, sm->transitions[i].to);
+    }
+
+    for (size_t i = 0; i < migrate_len; i++) {
+        id = hash_word(id, migrate[i]);
+    }
+
+    // 0 stands for "none"
+    return id ? id : 1;
+}
+
+static unsigned long long hash_word(unsigned long long hash, 
+                                    unsigned long long word) {
+    for (int i = 0; i < 8; i++) {
+        hash ^= (word >> (i * 8)) & 0xFF;
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static void chain_tags(SMDef* def, const SMDef* old, bool migrating) {
+    def->same_tags_len = 0;
+    def->source_tags_len = 0;
+
+    if (old && migrating) {
+        // Every version that shared handles with the old one is translated
+        memcpy(def->source_tags, old->same_tags, sizeof(def->source_tags));
+        def->source_tags_len = old->same_tags_len;
+    } else if (old) {
+        memcpy(def->same_tags, old->same_tags, sizeof(def->same_tags));
+        def->same_tags_len = old->same_tags_len;
+        memcpy(def->source_tags, old->source_tags, sizeof(def->source_tags));
+        def->source_tags_len = old->source_tags_len;
+    }
+
+    add_tag(def->same_tags, &def->same_tags_len, def->tag);
+}
+
+static void add_tag(unsigned* tags, size_t* len, unsigned tag) {
+    if (has_tag(tags, *len, tag)) {
+        return;
+    }
+
+    // The oldest version is forgotten first
+    if (*len == DEF_TAGS) {
+        memmove(tags, tags + 1, sizeof(*tags) * --*len);
+    }
+
+    tags[(*len)++] = tag;
+}
+
+static bool has_tag(const unsigned* tags, size_t len, unsigned tag) {
+    for (size_t i = 0; i < len; i++) {
+        if (tags[i] == tag) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int compare_rank(const void* a, const void* b) {
+    const SMRank* x = a;
+    const SMRank* y = b;
+
+    if (x->score != y->score) {
+        return (x->score < y->score) ? 1 : -1;
+    }
+
+    return (x->hdl > y->hdl) - (x->hdl < y->hdl);
+}
+
+static SMDef* acquire_def(SM* sm, unsigned* epoch) {
+    while (true) {
+        unsigned e = atomic_load(&sm->epoch);
+        atomic_fetch_add(&sm->readers[e & 1], 1);
+
+        // If a publisher moved the epoch on before we were counted it may not
+        // wait for us, so back off and pin the new epoch instead.
+        if (atomic_load(&sm->epoch) == e) {
+            *epoch = e;
+
+            return atomic_load(&sm->def);
+        }
+
+        atomic_fetch_sub(&sm->readers[e & 1], 1);
+    }
+}
+
+static SMStatus acquire_published(SM* sm, SMDef** def, unsigned* epoch) {
+    *def = acquire_def(sm, epoch);
+
+    while (*def == NULL) {
+        release_def(sm, *epoch);
+
+        // Nothing published yet: the definition registered so far is
+        // published on first use, as if sm_publish had been called
+        SMStatus status = publish(sm, NULL, 0, NULL, NULL);
+
+        if (status != SM_OK) {
             return status;
         }
+
+        *def = acquire_def(sm, epoch);
+    }
+
+    return SM_OK;
+}
+
+static void release_def(SM* sm, unsigned epoch) {
+    atomic_fetch_sub(&sm->readers[epoch & 1], 1);
+}
+
+static SMStateHdl sync_state(SM* sm, SMInstance* inst, SMDef* def) {
+    unsigned long long word = atomic_load(&inst->state);
+
+    while (WORD_TAG(word) != def->tag) {
+        SMStateHdl hdl = migrate_hdl(def, word);
+
+        if (atomic_compare_exchange_weak(&inst->state, &word, 
+                                         STATE_WORD(def->tag, hdl))) {
+            // Remembered states are only good while handles stay the same
+            if (!has_tag(def->same_tags, def->same_tags_len, WORD_TAG(word))) {
+                clear_history(inst);
+            }
+
+            // Whoever tracks the state (a router, say) follows it across
+            // versions; an instance that never had one has nothing to follow
+            if (sm->observer && WORD_TAG(word) != 0) {
+                sm->observer(sm, WORD_HDL(word), hdl, sm->observer_ctx);
+            }
+
+            return hdl;
+        }
+    }
+
+    return WORD_HDL(word);
+}
+
+static SMStateHdl migrate_hdl(SMDef* def, unsigned long long word) {
+    SMStateHdl hdl = WORD_HDL(word);
+    unsigned tag = WORD_TAG(word);
+
+    if (has_tag(def->same_tags, def->same_tags_len, tag)) {
+        // Same handles, perhaps laid out differently
+    } else if (has_tag(def->source_tags, def->source_tags_len, tag)) {
+        hdl = (hdl < def->migrate_len) ? def->migrate[hdl] : hdl;
+    } else {
+        // An instance left idle across more than one migration (say, in shared
+        // memory), or last run by an unrelated version, can't be translated
+        hdl = DUMMY_STATE_HDL;
+    }
+
+    // A state dropped without a mapping leaves the machine in the dummy state
+    return (hdl < def->states_len) ? hdl : DUMMY_STATE_HDL;
+}
+
+static SMStatus begin_dispatch(SM* sm, SMInstance* inst, bool* outermost) {
+    const void* owner = NULL;
+
+    // The raise queue and the running instance belong to the thread that is
+    // dispatching; any other has to wait its turn or use an SM of its own
+    if (!atomic_compare_exchange_strong_explicit(&sm->dispatcher, &owner, 
+                                                 &dispatch_thread, 
+                                                 memory_order_acquire, 
+                                                 memory_order_relaxed)) {
+        // Dispatch from within a handler or action stays on the running
+        // instance
+        *outermost = false;
+
+        return (owner == &dispatch_thread 
+            && (inst == NULL || inst == sm->running)) ? SM_OK : SM_BUSY;
+    }
+
+    // Fixed for the whole dispatch, raised events included, so rebinding
+    // the SM meanwhile does not move a transition between instances
+    sm->running = inst ? inst : atomic_load(&sm->inst);
+    *outermost = true;
+
+    return SM_OK;
+}
+
+static SMStatus end_dispatch(SM* sm, SMStatus status) {
+    // Raised events run to completion one after another; after a failure the
+    // rest of the chain is dropped rather than run against an unknown state.
+    while (sm->raised_len) {
+        SMRaisedEvent raised = sm->raised[sm->raised_head];
+        sm->raised_head = (sm->raised_head + 1) % SM_RAISE_QUEUE_SIZE;
+        sm->raised_len--;
+
+        if (status == SM_OK) {
+            status = dispatch_event(sm, raised.e, raised.args);
+        }
     }
 
-    return sm->states[state_hdl].on_enter();
+    atomic_store_explicit(&sm->dispatcher, NULL, memory_order_release);
+
+    return status;
 }
 
-static int exit_state(SM* sm, SMStateHdl state_hdl) {
-    int status = sm->states[state_hdl].on_exit();
+static SMStatus dispatch_event(SM* sm, int e, void* args) {
+    unsigned epoch;
+    SMDef* def;
+    SMStatus status = acquire_published(sm, &def, &epoch);
 
-    if (status) {
+    if (status != SM_OK) {
         return status;
     }
 
-    size_t ancestors = ancestor_count(sm, state_hdl);
+    status = handle(sm, def, e, args);
+    release_def(sm, epoch);
 
-    for (size_t i = 0; i < ancestors; i++) {
-        if ((status = get_ancestor(sm, state_hdl, i)->on_exit())) {
-            return status;
+    return status;
+}
+
+static SMStatus handle(SM* sm, SMDef* def, int e, void* args) {
+    SMStateHdl state_hdl = def->rank[sync_state(sm, sm->running, def)];
+    SMState* s = &def->states[state_hdl];
+    bool handled = false;
+
+    if (def->state_hits) {
+        atomic_fetch_add_explicit(&def->state_hits[state_hdl], 1, 
+                                  memory_order_relaxed);
+    }
+
+    while (true) {        
+        SMEventHandlerStatus status = s->ctx_handler 
+            ? s->ctx_handler(sm->context, def->order[s - def->states], e, args)
+            : s->handler(e, args);
+        
+        if (status == HS_ERROR) {
+            return SM_ERROR;
+        }
+
+        handled = status == HS_HANDLED;
+
+        if (handled || s->parent_hdl == SM_NO_PARENT) {
+            break;
         }
+
+        s = &def->states[s->parent_hdl];
     }
 
-    return 0;
+    if (!(handled || sm->ignore_unhandled_events)) {
+        return SM_UNHANDLED_EVENT;
+    }
+
+    SMEdge* edge = lookup_trans(def, state_hdl, e);
+
+    if (edge == NULL) {
+        return SM_OK;
+    }
+
+    if (def->edge_hits) {
+        atomic_fetch_add_explicit(&def->edge_hits[edge - def->edges], 1, 
+                                  memory_order_relaxed);
+    }
+
+    return transition(sm, def, state_hdl, edge->to);
 }
 
-static size_t ancestor_count(SM* sm, SMStateHdl state_hdl) {
-    size_t ancestors = 0;
-    SMState* s = &sm->states[state_hdl];
+static SMStatus transition(SM* sm, SMDef* def, SMStateHdl from, 
+                           SMStateHdl to) {
+    // Resolved before exiting, which updates the history being read
+    to = resolve_history(sm, def, to);
 
-    while (s->parent_hdl) {
-        ancestors++;
-        s = &sm->states[s->parent_hdl];
+    bool outermost = begin_transition(sm);
+    SMStatus status = SM_ERROR;
+
+    if (!exit_state(sm, def, from)) {
+        atomic_store_explicit(&sm->running->state, 
+                              STATE_WORD(def->tag, def->order[to]),
+                              memory_order_release);
+
+        if (sm->observer) {
+            sm->observer(sm, def->order[from], def->order[to], 
+                         sm->observer_ctx);
+        }
+
+        status = enter_state(sm, def, to) ? SM_ERROR : SM_OK;
     }
 
-    return ancestors;
+    if (outermost) {
+        end_transition(sm);
+    }
+
+    return status;
 }
 
-static SMState* get_ancestor(SM* sm, SMStateHdl state_hdl, size_t n) {
-    SMState* state = &sm->states[state_hdl];
+static bool begin_transition(SM* sm) {
+    unsigned long long seq = atomic_load_explicit(&sm->running->seq, 
+                                                  memory_order_relaxed);
 
-    if (!state->parent_hdl) {
-        return NULL;
+    // An action changing state directly nests inside the outer transition
+    if (seq & 1) {
+        return false;
     }
 
-    SMState* ancestor = state;
+    atomic_store_explicit(&sm->running->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    return true;
+}
+
+static void end_transition(SM* sm) {
+    unsigned long long seq = atomic_load_explicit(&sm->running->seq, 
+                                                  memory_order_relaxed);
+
+    atomic_store_explicit(&sm->running->seq, seq + 1, memory_order_release);
+}
+
+static SMStateHdl resolve_history(SM* sm, SMDef* def, SMStateHdl hdl) {
+    SMState* s = &def->states[hdl];
 
-    for (size_t i = 0; ancestor->parent_hdl && (i <= n); i++) {
-        ancestor = &sm->states[ancestor->parent_hdl];
+    if (s->history == SM_HISTORY_NONE) {
+        return hdl;
     }
 
-    return ancestor;
+    unsigned slot = def->history_slot[s->parent_hdl];
+    atomic_uint* remembered = (s->history == SM_HISTORY_DEEP) 
+        ? sm->running->deep : sm->running->shallow;
+    SMStateHdl last = atomic_load_explicit(&remembered[slot], 
+                                           memory_order_relaxed);
+
+    // Nothing remembered yet: enter the composite itself
+    return (last != DUMMY_STATE_HDL) ? def->rank[last] : s->parent_hdl;
 }
 
-static SMTransition* lookup_trans(SM* sm, SMStateHdl state_hdl, int e) {
-    for (size_t i = 0; i < sm->transitions_len; i++) {
-        SMTransition* trans = &sm->transitions[i];
+static void clear_history(SMInstance* inst) {
+    for (size_t i = 0; i < SM_HISTORY_SLOTS; i++) {
+        atomic_store_explicit(&inst->shallow[i], DUMMY_STATE_HDL, 
+                              memory_order_relaxed);
+        atomic_store_explicit(&inst->deep[i], DUMMY_STATE_HDL, 
+                              memory_order_relaxed);
+    }
+}
+
+static int enter_state(SM* sm, SMDef* def, SMStateHdl state_hdl) {
+    SMStateHdl* end = &def->paths[def->paths_first[state_hdl + 1]];
 
-        if ((trans->from == state_hdl) && (trans->on == e)) {
-            return trans;
+    for (SMStateHdl* hdl = &def->paths[def->paths_first[state_hdl]]; 
+         hdl < end; hdl++) {
+        SMState* s = &def->states[*hdl];
+        int status = s->ctx_on_enter 
+            ? s->ctx_on_enter(sm->context, def->order[*hdl]) : s->on_enter();
+
+        if (status) {
+            return status;
         }
     }
 
+    return 0;
+}
+
+static int exit_state(SM* sm, SMDef* def, SMStateHdl state_hdl) {
+    SMStateHdl* path = &def->paths[def->paths_first[state_hdl]];
+    size_t len = def->paths_first[state_hdl + 1] - def->paths_first[state_hdl];
+
+    for (size_t i = len; i > 0; i--) {
+        SMStateHdl hdl = path[i - 1];
+        unsigned slot = def->history_slot[hdl];
+
+        // Composites with history remember the leaf and the direct substate
+        // they are being left from
+        if (slot != NO_HISTORY_SLOT && i < len) {
+            atomic_store_explicit(&sm->running->deep[slot], 
+                                  def->order[state_hdl], memory_order_relaxed);
+            atomic_store_explicit(&sm->running->shallow[slot], 
+                                  def->order[path[i]], memory_order_relaxed);
+        }
+
+        SMState* s = &def->states[hdl];
+        int status = s->ctx_on_exit 
+            ? s->ctx_on_exit(sm->context, def->order[hdl]) : s->on_exit();
+
+        if (status) {
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+static size_t draft_depth(SM* sm, SMStateHdl state_hdl) {
+    size_t depth = 0;
     SMState* s = &sm->states[state_hdl];
 
+    while (s->parent_hdl) {
+        depth++;
+        s = &sm->states[s->parent_hdl];
+    }
+
+    return depth;
+}
+
+static SMEdge* lookup_trans(SMDef* def, SMStateHdl state_hdl, int e) {
+    SMEdge* end = &def->edges[def->edges_first[state_hdl + 1]];
+
+    for (SMEdge* edge = &def->edges[def->edges_first[state_hdl]]; edge < end; 
+         edge++) {
+        if (edge->on == e) {
+            return edge;
+        }
+    }
+
+    SMState* s = &def->states[state_hdl];
+
     return (s->parent_hdl == SM_NO_PARENT) ? NULL 
-                                           : lookup_trans(sm, s->parent_hdl, e);
+                                           : lookup_trans(def, s->parent_hdl, e);
 }
 
 static bool valid_transition(SM* sm, SMTransition* trans) {
-    return valid_state_hdl(sm, trans->from) && valid_state_hdl(sm, trans->to);
+    return valid_state_hdl(sm->states_len, trans->from) 
+        && valid_state_hdl(sm->states_len, trans->to);
 }
 
-static bool valid_state_hdl(SM* sm, SMStateHdl hdl) {
-    return hdl <= sm->states_len;
+static bool valid_state_hdl(size_t states_len, SMStateHdl hdl) {
+    return hdl < states_len;
 }
 
 static SMEventHandlerStatus dummy_handler(int e, void* args) {
@@ -281,4 +1475,3 @@ static SMStatus dummy_on_enter(void) {
 static SMStatus dummy_on_exit(void) { 
     return 0; 
 }
-
@@ -3,20 +3,34 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct SM SM;
 typedef unsigned SMStateHdl;
 typedef struct SMTransition SMTransition;
 typedef struct SMState SMState;
 typedef struct SMConfig SMConfig;
+typedef struct SMSnapshot SMSnapshot;
+typedef struct SMReport SMReport;
+#ifndef __cplusplus
 typedef enum SMStatus SMStatus;
 typedef enum SMEventHandlerStatus SMEventHandlerStatus;
+typedef enum SMHistory SMHistory;
+typedef enum SMDefect SMDefect;
+#endif
 
 enum SMStatus {
-    SM_OK                 = 0,
-    SM_ERROR              = -1,
-    SM_INVALID_TRANSITION = -2,
-    SM_INVALID_STATE      = -3,
-    SM_UNHANDLED_EVENT    = -4,
+    SM_OK                  = 0,
+    SM_ERROR               = -1,
+    SM_INVALID_TRANSITION  = -2,
+    SM_INVALID_STATE       = -3,
+    SM_UNHANDLED_EVENT     = -4,
+    SM_QUEUE_FULL          = -5,
+    SM_BUSY                = -6,
+    SM_UNKNOWN_KEY         = -7,
+    SM_DEFINITION_MISMATCH = -8,
 };
 
 enum SMEventHandlerStatus {
@@ -25,7 +39,30 @@ enum SMEventHandlerStatus {
     HS_UNHANDLED = 1
 };
 
+/* A state registered with a history kind is a pseudo-state of its parent:
+ * transitioning to it re-enters the parent's most recently active direct
+ * substate (shallow) or leaf (deep), or the parent itself the first time. */
+enum SMHistory {
+    SM_HISTORY_NONE    = 0,
+    SM_HISTORY_SHALLOW = 1,
+    SM_HISTORY_DEEP    = 2
+};
+
+enum SMDefect {
+    SM_DEFECT_NONE                    = 0,
+    SM_DEFECT_DANGLING_PARENT         = 1,
+    SM_DEFECT_PARENT_CYCLE            = 2,
+    SM_DEFECT_NO_HANDLER              = 3,
+    SM_DEFECT_BAD_HISTORY             = 4,
+    SM_DEFECT_TOO_MANY_HISTORIES      = 5,
+    SM_DEFECT_DANGLING_TRANSITION     = 6,
+    SM_DEFECT_CONFLICTING_TRANSITIONS = 7
+};
+
 typedef SMEventHandlerStatus (*SMEventHandler)(int, void*);
+typedef SMEventHandlerStatus (*SMContextHandler)(void*, SMStateHdl, int, void*);
+typedef int (*SMContextAction)(void*, SMStateHdl);
+typedef void (*SMObserver)(SM*, SMStateHdl from, SMStateHdl to, void*);
 
 struct SMTransition {
     SMStateHdl from;
@@ -38,27 +75,174 @@ struct SMState {
     SMStateHdl parent_hdl;
     int (*on_enter)(void);
     int (*on_exit)(void);
+    SMHistory history;
+    /* Used instead of the above when set, and called with the SM's context
+     * (see sm_set_context) and the state's handle. */
+    SMContextHandler ctx_handler;
+    SMContextAction ctx_on_enter;
+    SMContextAction ctx_on_exit;
 };
 
 struct SMConfig {
     bool ignore_unhandled_events;
     size_t init_states_size;
     size_t init_transitions_size;
+    bool profile;
+};
+
+struct SMSnapshot {
+    SMStateHdl state;
+    unsigned version;
+    unsigned long long transitions;
+    bool in_transition;
+};
+
+/* The first defect found, if any. `transition` indexes the registered
+ * transitions and is only meaningful for transition defects. States no
+ * transition can enter are not defects (they may be initial states set with
+ * sm_set_state) and are only counted. */
+struct SMReport {
+    SMDefect defect;
+    SMStateHdl state;
+    size_t transition;
+    size_t unreachable;
+    SMStateHdl first_unreachable;
 };
 
 enum { SM_NO_PARENT = 0 };
 
+#ifndef SM_RAISE_QUEUE_SIZE
+#define SM_RAISE_QUEUE_SIZE 8
+#endif
+
+/* Composite states with history a machine may have */
+#ifndef SM_HISTORY_SLOTS
+#define SM_HISTORY_SLOTS 8
+#endif
+
 SMStatus sm_create(SM**, SMConfig);
 
 void sm_destroy(SM*);
 
 SMStatus sm_register_state(SM*, SMStateHdl*, SMState); 
 
+/* If nothing has been published yet, the states and transitions registered
+ * so far are published first, as by sm_publish(sm, NULL, 0); its failure is
+ * returned as is. Registrations made after that take effect on the next
+ * sm_publish only. One thread dispatches an SM at a time; others get SM_BUSY
+ * meanwhile, so threads that dispatch concurrently need an SM each. The same
+ * goes for sm_set_state. */
 SMStatus sm_handle(SM*, int, void*);
 
+/* Raises an internal event from a handler or action of the same machine. It
+ * is queued and handled once the current transition completes, before control
+ * returns to whoever dispatched the external event. Outside of dispatch it is
+ * handled straight away. */
+SMStatus sm_raise(SM*, int, void*);
+
 SMStatus sm_set_state(SM*, SMStateHdl);
 
+/* sm_set_state without checking the handle, for callers that know it is one
+ * of the published version's states. Everything else the dispatch path relies
+ * on was verified when the version was published. */
+SMStatus sm_set_state_unchecked(SM*, SMStateHdl);
+
 SMStatus sm_add_transition(SM*, SMTransition);
 
+/* Safe to call from any thread; never blocks the dispatching thread. */
+SMStateHdl sm_current_state(const SM*);
+
+/* Reads the current state together with the number of completed transitions
+ * and whether a transition is in progress, consistently and without locking.
+ * While in transition, `state` is the source until its exit actions have run
+ * and the target afterwards. `version` tags the published version `state`
+ * belongs to (it is derived from sm_definition_id); 0 if none yet. */
+void sm_snapshot(const SM*, SMSnapshot*);
+
+/* Passed to the ctx_ callbacks of the SM's states, e.g. to find the object
+ * a wrapper keeps their callables in. */
+void sm_set_context(SM*, void*);
+
+/* Called on every state change, after the source's exit actions and before
+ * the target's entry actions. Also called, with no actions around it, when a
+ * newly published version reaches the machine: `from` is then its handle in
+ * the previous version and `to` the one in the new version, which may be the
+ * same. Always called on the thread dispatching the machine, never from
+ * sm_publish. One observer per machine; NULL removes it. */
+void sm_set_observer(SM*, SMObserver, void*);
+
+/* Parent of a state in the published version; SM_NO_PARENT for top-level. */
+SMStatus sm_state_parent(SM*, SMStateHdl, SMStateHdl*);
+
+/* A machine's running state (current state, transition counter, history) can live
+ * in caller-provided storage instead of inside the SM, e.g. in memory shared
+ * between processes. The storage holds no pointers, so it may be mapped at
+ * different addresses. */
+size_t sm_instance_size(void);
+
+void sm_instance_init(void*);
+
+/* Closes the transition left open by a dispatcher that died mid-transition. */
+void sm_instance_recover(void*);
+
+void sm_instance_snapshot(const void*, SMSnapshot*);
+
+/* Makes the SM run on the given instance storage; NULL goes back to its own.
+ * sm_current_state and sm_snapshot report the bound instance. */
+void sm_bind_instance(SM*, void*);
+
+/* sm_handle and sm_set_state on the given instance storage for this call
+ * only, leaving the bound instance alone; NULL means the bound one. From
+ * within a dispatch on another instance, SM_BUSY. */
+SMStatus sm_handle_instance(SM*, void*, int, void*);
+
+SMStatus sm_set_state_instance(SM*, void*, SMStateHdl);
+
+/* Checks the registered states and transitions as sm_publish would, without
+ * publishing. Returns SM_INVALID_STATE or SM_INVALID_TRANSITION for a defect
+ * and fills the report, which may be NULL. */
+SMStatus sm_verify(SM*, SMReport*);
+
+/* Snapshots the states and transitions registered so far into an immutable
+ * version and atomically makes it the one new events are dispatched against.
+ * Dispatch already in flight finishes on the version it started with, which is
+ * freed once no thread references it. `migrate` maps each handle of the
+ * previously published version to its handle in this one; NULL keeps handles
+ * as they are. A machine moves to its handle in the new version when it is
+ * next dispatched, so until then sm_current_state reports the old one (see
+ * SMSnapshot.version); one left idle across two migrating publishes falls
+ * back to the dummy state. Publishing must not be done from within a handler
+ * or action. */
+SMStatus sm_publish(SM*, const SMStateHdl* migrate, size_t migrate_len);
+
+/* Identifies the published version by its states, transitions and the last
+ * migration map, but not by how often it was published, so processes sharing
+ * instances can tell whether they run the same one. Publishes on first use
+ * like sm_handle. */
+SMStatus sm_definition_id(SM*, unsigned long long* id);
+
+/* Whether the published version takes over instances left on version `id`,
+ * i.e. `id` is one of the last few versions it keeps or migrates handles of. */
+SMStatus sm_definition_follows(SM*, unsigned long long id, bool* follows);
+
+/* Moves handles of the version `*version` (an SMSnapshot.version) to the
+ * published version the way machines in those states migrate, and sets
+ * `*version` to the latter. States without a counterpart become SM_NO_PARENT.
+ * Lets whoever keeps handles of its own (a router, say) follow the machine. */
+SMStatus sm_translate_states(SM*, unsigned* version, SMStateHdl*, size_t);
+
+/* Republishes the definition with the states and transitions the published
+ * version used most laid out first. Requires SMConfig.profile, which counts
+ * their use. Handles seen by callers do not change. Returns SM_BUSY while the
+ * draft has states or transitions that are not published yet. */
+SMStatus sm_optimize_layout(SM*);
+
+/* Discards the registered states and transitions so a new definition can be
+ * built from scratch. The published version is left untouched. */
+void sm_reset_definition(SM*);
+
 const char* sm_status_str(SMStatus);
 
+#ifdef __cplusplus
+}
+#endif
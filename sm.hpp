@@ -0,0 +1,375 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "sm.h"
+
+/* A typed runtime over the C engine. Events are alternatives of a
+ * std::variant passed by address, handlers and actions are lambdas (captures
+ * included) kept in fixed inline buffers, and nothing is heap-allocated per
+ * state or per event. The engine still does the dispatching: every state gets
+ * a trampoline instantiated for the type of its callable, which the engine
+ * calls with the machine as context, so the callable itself is called
+ * directly and can be inlined into it. */
+namespace hsm {
+
+using StateHdl = SMStateHdl;
+using Status = SMStatus;
+using HandlerStatus = SMEventHandlerStatus;
+
+inline constexpr StateHdl NO_PARENT = SM_NO_PARENT;
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(Status status)
+        : std::runtime_error(sm_status_str(status)), status_(status) {}
+
+    Status status() const noexcept { return status_; }
+
+private:
+    Status status_;
+};
+
+namespace detail {
+
+template <class E, class... Ts>
+constexpr int index_of() {
+    int i = 0;
+    int found = -1;
+
+    ((found = (found < 0 && std::is_same_v<E, Ts>) ? i : found, i++), ...);
+
+    return found;
+}
+
+}
+
+template <class Signature, std::size_t Capacity = 4 * sizeof(void*)>
+class InlineFunction;
+
+/* Move-only callable with small-buffer storage and no heap fallback: a
+ * callable that does not fit is a compile error rather than an allocation. */
+template <class R, class... Args, std::size_t Capacity>
+class InlineFunction<R(Args...), Capacity> {
+public:
+    InlineFunction() noexcept = default;
+
+    template <class F, class = std::enable_if_t<
+        !std::is_same_v<std::decay_t<F>, InlineFunction>>>
+    InlineFunction(F&& f) {
+        using Fn = std::decay_t<F>;
+
+        static_assert(sizeof(Fn) <= Capacity,
+                      "callable too large for its inline buffer");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t),
+                      "callable over-aligned for its inline buffer");
+        static_assert(std::is_nothrow_move_constructible_v<Fn>,
+                      "callable must be nothrow move constructible");
+
+        ::new (static_cast<void*>(buf_)) Fn(std::forward<F>(f));
+        invoke_ = [](void* fn, Args... args) -> R {
+            return (*static_cast<Fn*>(fn))(std::forward<Args>(args)...);
+        };
+        manage_ = [](void* dst, void* src) noexcept {
+            if (dst) {
+                ::new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            }
+
+            static_cast<Fn*>(src)->~Fn();
+        };
+    }
+
+    InlineFunction(InlineFunction&& other) noexcept { take(other); }
+
+    InlineFunction& operator=(InlineFunction&& other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+
+        return *this;
+    }
+
+    InlineFunction(const InlineFunction&) = delete;
+    InlineFunction& operator=(const InlineFunction&) = delete;
+
+    ~InlineFunction() { reset(); }
+
+    explicit operator bool() const noexcept { return invoke_ != nullptr; }
+
+    /* The stored callable, for callers that know it is an `F`. */
+    template <class F>
+    F* target() noexcept {
+        return std::launder(reinterpret_cast<F*>(buf_));
+    }
+
+    R operator()(Args... args) {
+        return invoke_(buf_, std::forward<Args>(args)...);
+    }
+
+private:
+    void take(InlineFunction& other) noexcept {
+        if (other.invoke_) {
+            other.manage_(buf_, other.buf_);
+            invoke_ = std::exchange(other.invoke_, nullptr);
+            manage_ = std::exchange(other.manage_, nullptr);
+        }
+    }
+
+    void reset() noexcept {
+        if (invoke_) {
+            manage_(nullptr, buf_);
+            invoke_ = nullptr;
+            manage_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char buf_[Capacity];
+    R (*invoke_)(void*, Args...) = nullptr;
+    void (*manage_)(void*, void*) noexcept = nullptr;
+};
+
+/* `Events` are the payload types a machine accepts; an event's engine id is
+ * its index in the list, and its args a pointer to the Event, which is also
+ * what dispatching through native() (an index, router or shm segment) must
+ * pass. Up to `MaxStates` states can be registered. */
+template <std::size_t MaxStates, class... Events>
+class Machine {
+public:
+    using Event = std::variant<Events...>;
+    using Handler = InlineFunction<HandlerStatus(const Event&)>;
+    using Action = InlineFunction<int()>;
+
+    template <class E>
+    static constexpr int event_id = detail::index_of<E, Events...>();
+
+    explicit Machine(SMConfig cfg = {false, MaxStates + 1, MaxStates + 1,
+                                     false}) {
+        check(sm_create(&sm_, cfg));
+        sm_set_context(sm_, this);
+    }
+
+    Machine(Machine&& other) noexcept
+        : sm_(std::exchange(other.sm_, nullptr)),
+          slots_(std::move(other.slots_)),
+          registered_(other.registered_),
+          raised_(std::move(other.raised_)),
+          raised_next_(other.raised_next_) {
+        if (sm_) {
+            sm_set_context(sm_, this);
+        }
+    }
+
+    Machine& operator=(Machine&& other) noexcept {
+        if (this != &other) {
+            destroy();
+            sm_ = std::exchange(other.sm_, nullptr);
+            slots_ = std::move(other.slots_);
+            registered_ = other.registered_;
+            raised_ = std::move(other.raised_);
+            raised_next_ = other.raised_next_;
+
+            if (sm_) {
+                sm_set_context(sm_, this);
+            }
+        }
+
+        return *this;
+    }
+
+    Machine(const Machine&) = delete;
+    Machine& operator=(const Machine&) = delete;
+
+    ~Machine() { destroy(); }
+
+    /* Handlers take a `const Event&` and actions nothing; either may be
+     * already type-erased (Handler, Action), at the cost of a second
+     * indirect call. */
+    template <class H, class Enter = std::nullptr_t,
+              class Exit = std::nullptr_t>
+    StateHdl add_state(H&& handler, StateHdl parent = NO_PARENT,
+                       Enter&& on_enter = nullptr, Exit&& on_exit = nullptr) {
+        if (registered_ >= SLOTS) {
+            throw Error(SM_ERROR);
+        }
+
+        SMStateHdl hdl;
+        SMState state = {nullptr, parent, nullptr, nullptr, SM_HISTORY_NONE,
+                         &handler_trampoline<std::decay_t<H>>,
+                         action_trampoline<&Slot::on_enter>(on_enter),
+                         action_trampoline<&Slot::on_exit>(on_exit)};
+
+        check(sm_register_state(sm_, &hdl, state));
+
+        slots_[hdl].handler = Handler(std::forward<H>(handler));
+        slots_[hdl].on_enter = make_action(std::forward<Enter>(on_enter));
+        slots_[hdl].on_exit = make_action(std::forward<Exit>(on_exit));
+        registered_ = hdl + 1;
+
+        return hdl;
+    }
+
+    /* A history pseudo-state of `composite`, to be used as a target. */
+    StateHdl add_history(StateHdl composite, SMHistory kind) {
+        if (registered_ >= SLOTS) {
+            throw Error(SM_ERROR);
+        }
+
+        SMStateHdl hdl;
+        SMState state = {nullptr, composite, nullptr, nullptr, kind,
+                         nullptr, nullptr, nullptr};
+
+        check(sm_register_state(sm_, &hdl, state));
+        registered_ = hdl + 1;
+
+        return hdl;
+    }
+
+    template <class E>
+    void add_transition(StateHdl from, StateHdl to) {
+        static_assert(event_id<E> >= 0, "not an event of this machine");
+
+        check(sm_add_transition(sm_, {from, event_id<E>, to}));
+    }
+
+    void publish(const StateHdl* migrate = nullptr, std::size_t len = 0) {
+        check(sm_publish(sm_, migrate, len));
+    }
+
+    [[nodiscard]] Status handle(const Event& e) {
+        return sm_handle(sm_, static_cast<int>(e.index()),
+                         const_cast<Event*>(&e));
+    }
+
+    template <class E, class = std::enable_if_t<
+        !std::is_same_v<std::decay_t<E>, Event>>>
+    [[nodiscard]] Status handle(E&& e) {
+        Event ev(std::in_place_type<std::decay_t<E>>, std::forward<E>(e));
+
+        return handle(ev);
+    }
+
+    /* From a handler or action of this machine; the event is copied into a
+     * ring that outlives the handler, matching the engine's raise queue. */
+    template <class E>
+    [[nodiscard]] Status raise(E&& e) {
+        std::size_t taken = raised_next_;
+        std::optional<Event>& slot = raised_[taken];
+        slot.emplace(std::in_place_type<std::decay_t<E>>, std::forward<E>(e));
+
+        // Outside of dispatch the engine handles it right away, and whatever
+        // its handler raises must not land in the slot still being handled
+        raised_next_ = (taken + 1) % raised_.size();
+        Status status = sm_raise(sm_, static_cast<int>(slot->index()), 
+                                 &*slot);
+
+        if (status != SM_OK && raised_next_ == (taken + 1) % raised_.size()) {
+            raised_next_ = taken;
+        }
+
+        return status;
+    }
+
+    [[nodiscard]] Status set_state(StateHdl hdl) {
+        return sm_set_state(sm_, hdl);
+    }
+
+    StateHdl current_state() const { return sm_current_state(sm_); }
+
+    SMSnapshot snapshot() const {
+        SMSnapshot out;
+        sm_snapshot(sm_, &out);
+
+        return out;
+    }
+
+    SM* native() const noexcept { return sm_; }
+
+private:
+    struct Slot {
+        Handler handler;
+        Action on_enter;
+        Action on_exit;
+    };
+
+    // The engine calls these with the machine as context and the state's
+    // handle; `F` is the stored callable's type, so the call into it is direct
+    template <class F>
+    static SMEventHandlerStatus handler_trampoline(void* ctx, SMStateHdl hdl,
+                                                   int, void* args) {
+        Handler& handler = static_cast<Machine*>(ctx)->slots_[hdl].handler;
+        const Event& e = *static_cast<const Event*>(args);
+
+        if constexpr (std::is_same_v<F, Handler>) {
+            return handler(e);
+        } else {
+            return (*handler.template target<F>())(e);
+        }
+    }
+
+    template <Action Slot::*Member, class F>
+    static int typed_action(void* ctx, SMStateHdl hdl) {
+        Action& action = static_cast<Machine*>(ctx)->slots_[hdl].*Member;
+
+        if constexpr (std::is_same_v<F, Action>) {
+            return action();
+        } else {
+            return (*action.template target<F>())();
+        }
+    }
+
+    template <Action Slot::*Member, class F>
+    static SMContextAction action_trampoline(const F& action) {
+        using Fn = std::decay_t<F>;
+
+        if constexpr (std::is_null_pointer_v<Fn>) {
+            return nullptr;
+        } else if constexpr (std::is_same_v<Fn, Action>) {
+            return action ? &typed_action<Member, Fn> : nullptr;
+        } else {
+            return &typed_action<Member, Fn>;
+        }
+    }
+
+    template <class F>
+    static Action make_action(F&& action) {
+        if constexpr (std::is_null_pointer_v<std::decay_t<F>>) {
+            return {};
+        } else {
+            return Action(std::forward<F>(action));
+        }
+    }
+
+    // Handle 0 is the engine's own dummy state
+    static constexpr std::size_t SLOTS = MaxStates + 1;
+
+    static void check(Status status) {
+        if (status != SM_OK) {
+            throw Error(status);
+        }
+    }
+
+    void destroy() noexcept {
+        if (sm_) {
+            sm_destroy(sm_);
+            sm_ = nullptr;
+        }
+    }
+
+    SM* sm_ = nullptr;
+    std::array<Slot, SLOTS> slots_;
+    StateHdl registered_ = 1;
+    // Besides a full engine queue, the raised event being handled stays alive
+    // while its handler raises the next one, and a slot must be free to fill
+    std::array<std::optional<Event>, SM_RAISE_QUEUE_SIZE + 2> raised_;
+    std::size_t raised_next_ = 0;
+};
+
+}
@@ -0,0 +1,361 @@
+#include "sm_index.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+// At least one slot stays empty, so probes for absent keys terminate early
+#define MAX_LOAD(cap) ((cap) - (cap) / 8 - ((cap) < 8))
+#define BATCH_LEN 16
+
+typedef struct SMIndexSlot SMIndexSlot;
+typedef struct SMIndexShard SMIndexShard;
+
+/* An empty slot has no machine; any key, including 0, can be stored. */
+struct SMIndexSlot {
+    atomic_ullong key;
+    _Atomic(SM*) sm;
+};
+
+/* Writers bump `seq` to odd before touching the slots and back to even after,
+ * so readers can tell whether what they probed was stable. */
+struct SMIndexShard {
+    _Alignas(CACHE_LINE) atomic_uint seq;
+    atomic_flag lock;
+    size_t mask;
+    size_t len;
+    SMIndexSlot* slots;
+};
+
+struct SMIndex {
+    SMIndexShard* shards;
+    size_t shards_len;
+    unsigned shard_shift;
+};
+
+static uint64_t hash_key(uint64_t);
+static SMIndexShard* shard_of(SMIndex*, uint64_t);
+static SM* probe(SMIndexShard*, uint64_t, uint64_t);
+static size_t distance(SMIndexShard*, size_t, uint64_t);
+static void lock_shard(SMIndexShard*);
+static void unlock_shard(SMIndexShard*);
+static size_t round_pow2(size_t);
+static size_t isqrt(size_t);
+
+SMStatus sm_index_create(SMIndex** out, size_t capacity, size_t shards) {
+    SMIndex* index = malloc(sizeof(*index));
+
+    if (index == NULL) {
+        return SM_ERROR;
+    }
+
+    index->shards_len = round_pow2(shards ? shards : 1);
+    index->shard_shift = 64;
+
+    for (size_t n = index->shards_len; n > 1; n >>= 1) {
+        index->shard_shift--;
+    }
+
+    // Keys do not split evenly: the fullest of many shards holds several
+    // standard deviations (about sqrt(mean)) over the mean, so each shard gets
+    // that much headroom, and room for it at the shards' maximum load
+    size_t mean = (capacity + index->shards_len - 1) / index->shards_len;
+    size_t per_shard = mean + 6 * isqrt(mean) + 8;
+    size_t slots_len = round_pow2(per_shard + per_shard / 7 + 1);
+
+    index->shards = aligned_alloc(CACHE_LINE, 
+                                  sizeof(SMIndexShard) * index->shards_len);
+
+    if (index->shards == NULL) {
+        free(index);
+
+        return SM_ERROR;
+    }
+
+    for (size_t i = 0; i < index->shards_len; i++) {
+        SMIndexShard* shard = &index->shards[i];
+
+        atomic_init(&shard->seq, 0);
+        atomic_flag_clear(&shard->lock);
+        shard->mask = slots_len - 1;
+        shard->len = 0;
+        shard->slots = aligned_alloc(CACHE_LINE, 
+                                     sizeof(SMIndexSlot) * slots_len);
+
+        if (shard->slots == NULL) {
+            index->shards_len = i;
+            sm_index_destroy(index);
+
+            return SM_ERROR;
+        }
+
+        for (size_t j = 0; j < slots_len; j++) {
+            atomic_init(&shard->slots[j].key, 0);
+            atomic_init(&shard->slots[j].sm, NULL);
+        }
+    }
+
+    *out = index;
+
+    return SM_OK;
+}
+
+void sm_index_destroy(SMIndex* index) {
+    for (size_t i = 0; i < index->shards_len; i++) {
+        free(index->shards[i].slots);
+    }
+
+    free(index->shards);
+    free(index);
+}
+
+SMStatus sm_index_insert(SMIndex* index, uint64_t key, SM* sm) {
+    if (sm == NULL) {
+        return SM_ERROR;
+    }
+
+    uint64_t hash = hash_key(key);
+    SMIndexShard* shard = shard_of(index, hash);
+    SMStatus status = SM_OK;
+
+    lock_shard(shard);
+
+    size_t i = hash & shard->mask;
+    size_t dist = 0;
+
+    while (true) {
+        SMIndexSlot* slot = &shard->slots[i];
+        SM* slot_sm = atomic_load_explicit(&slot->sm, memory_order_relaxed);
+        uint64_t slot_key = atomic_load_explicit(&slot->key, 
+                                                 memory_order_relaxed);
+
+        if (slot_sm == NULL) {
+            if (shard->len == MAX_LOAD(shard->mask + 1)) {
+                status = SM_ERROR;
+                break;
+            }
+
+            atomic_store_explicit(&slot->key, key, memory_order_relaxed);
+            atomic_store_explicit(&slot->sm, sm, memory_order_relaxed);
+            shard->len++;
+            break;
+        }
+
+        if (slot_key == key) {
+            atomic_store_explicit(&slot->sm, sm, memory_order_relaxed);
+            break;
+        }
+
+        // Robin Hood: the entry further from home keeps the slot
+        size_t slot_dist = distance(shard, i, slot_key);
+
+        if (slot_dist < dist) {
+            if (shard->len == MAX_LOAD(shard->mask + 1)) {
+                status = SM_ERROR;
+                break;
+            }
+
+            atomic_store_explicit(&slot->key, key, memory_order_relaxed);
+            atomic_store_explicit(&slot->sm, sm, memory_order_relaxed);
+            key = slot_key;
+            sm = slot_sm;
+            dist = slot_dist;
+        }
+
+        i = (i + 1) & shard->mask;
+        dist++;
+    }
+
+    unlock_shard(shard);
+
+    return status;
+}
+
+SMStatus sm_index_remove(SMIndex* index, uint64_t key) {
+    uint64_t hash = hash_key(key);
+    SMIndexShard* shard = shard_of(index, hash);
+    SMStatus status = SM_UNKNOWN_KEY;
+
+    lock_shard(shard);
+
+    size_t i = hash & shard->mask;
+
+    for (size_t dist = 0; ; dist++, i = (i + 1) & shard->mask) {
+        SMIndexSlot* slot = &shard->slots[i];
+        uint64_t slot_key = atomic_load_explicit(&slot->key, 
+                                                 memory_order_relaxed);
+
+        if (atomic_load_explicit(&slot->sm, memory_order_relaxed) == NULL 
+            || distance(shard, i, slot_key) < dist) {
+            break;
+        }
+
+        if (slot_key != key) {
+            continue;
+        }
+
+        // Backward-shift the entries after it so probes stay tombstone-free
+        size_t next = (i + 1) & shard->mask;
+
+        while (true) {
+            SMIndexSlot* from = &shard->slots[next];
+            SM* from_sm = atomic_load_explicit(&from->sm, memory_order_relaxed);
+            uint64_t from_key = atomic_load_explicit(&from->key, 
+                                                     memory_order_relaxed);
+
+            if (from_sm == NULL || distance(shard, next, from_key) == 0) {
+                break;
+            }
+
+            atomic_store_explicit(&shard->slots[i].key, from_key, 
+                                  memory_order_relaxed);
+            atomic_store_explicit(&shard->slots[i].sm, from_sm, 
+                                  memory_order_relaxed);
+            i = next;
+            next = (next + 1) & shard->mask;
+        }
+
+        atomic_store_explicit(&shard->slots[i].sm, NULL, memory_order_relaxed);
+        shard->len--;
+        status = SM_OK;
+        break;
+    }
+
+    unlock_shard(shard);
+
+    return status;
+}
+
+SM* sm_index_find(SMIndex* index, uint64_t key) {
+    uint64_t hash = hash_key(key);
+
+    return probe(shard_of(index, hash), hash, key);
+}
+
+void sm_index_find_batch(SMIndex* index, const uint64_t* keys, size_t n, 
+                         SM** out) {
+    uint64_t hashes[BATCH_LEN];
+
+    for (size_t base = 0; base < n; base += BATCH_LEN) {
+        size_t len = (n - base < BATCH_LEN) ? n - base : BATCH_LEN;
+
+        // Issue every home slot's load first so the misses overlap
+        for (size_t i = 0; i < len; i++) {
+            hashes[i] = hash_key(keys[base + i]);
+            SMIndexShard* shard = shard_of(index, hashes[i]);
+
+            __builtin_prefetch(&shard->slots[hashes[i] & shard->mask]);
+        }
+
+        for (size_t i = 0; i < len; i++) {
+            out[base + i] = probe(shard_of(index, hashes[i]), hashes[i], 
+                                  keys[base + i]);
+        }
+    }
+}
+
+SMStatus sm_index_handle(SMIndex* index, uint64_t key, int e, void* args) {
+    SM* sm = sm_index_find(index, key);
+
+    return sm ? sm_handle(sm, e, args) : SM_UNKNOWN_KEY;
+}
+
+static uint64_t hash_key(uint64_t key) {
+    // splitmix64 finalizer; sequential ids spread over shards and slots
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+
+    return key;
+}
+
+static SMIndexShard* shard_of(SMIndex* index, uint64_t hash) {
+    // High bits pick the shard, low bits the slot within it
+    return &index->shards[(index->shard_shift == 64) ? 0 
+                                                     : hash >> index->shard_shift];
+}
+
+static SM* probe(SMIndexShard* shard, uint64_t hash, uint64_t key) {
+    while (true) {
+        unsigned seq = atomic_load_explicit(&shard->seq, memory_order_acquire);
+
+        if (seq & 1) {
+            continue;
+        }
+
+        SM* found = NULL;
+        size_t i = hash & shard->mask;
+
+        for (size_t dist = 0; dist <= shard->mask; 
+             dist++, i = (i + 1) & shard->mask) {
+            SMIndexSlot* slot = &shard->slots[i];
+            SM* sm = atomic_load_explicit(&slot->sm, memory_order_relaxed);
+            uint64_t slot_key = atomic_load_explicit(&slot->key, 
+                                                     memory_order_relaxed);
+
+            // Robin Hood lets a probe stop at the first entry closer to home
+            if (sm == NULL || distance(shard, i, slot_key) < dist) {
+                break;
+            }
+
+            if (slot_key == key) {
+                found = sm;
+                break;
+            }
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&shard->seq, memory_order_relaxed) == seq) {
+            return found;
+        }
+    }
+}
+
+static size_t distance(SMIndexShard* shard, size_t i, uint64_t key) {
+    return (i - hash_key(key)) & shard->mask;
+}
+
+static void lock_shard(SMIndexShard* shard) {
+    while (atomic_flag_test_and_set_explicit(&shard->lock, 
+                                             memory_order_acquire)) {
+        // Writers hold a shard only for one probe sequence
+    }
+
+    unsigned seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+    atomic_store_explicit(&shard->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void unlock_shard(SMIndexShard* shard) {
+    unsigned seq = atomic_load_explicit(&shard->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&shard->seq, seq + 1, memory_order_release);
+    atomic_flag_clear_explicit(&shard->lock, memory_order_release);
+}
+
+static size_t round_pow2(size_t n) {
+    size_t pow2 = 1;
+
+    while (pow2 < n) {
+        pow2 <<= 1;
+    }
+
+    return pow2;
+}
+
+static size_t isqrt(size_t n) {
+    // Newton's method from above; stops once the estimate stops shrinking
+    size_t root = n;
+    size_t next = (root + 1) / 2;
+
+    while (next < root) {
+        root = next;
+        next = (root + n / root) / 2;
+    }
+
+    return root;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maps 64-bit external ids (connection ids, device serials) to machines.
+ * Open addressing with Robin Hood probing over fixed-capacity shards: lookups
+ * from any number of threads take no lock and retry only if a writer touched
+ * their shard meanwhile; inserts and removes lock just their shard. A removed
+ * machine may still be returned to a lookup racing the removal, so callers
+ * must not destroy it until such lookups are done. */
+typedef struct SMIndex SMIndex;
+
+/* `shards` is rounded up to a power of two. */
+SMStatus sm_index_create(SMIndex**, size_t capacity, size_t shards);
+
+void sm_index_destroy(SMIndex*);
+
+/* Replaces the machine if the key is present; SM_ERROR if its shard is full. */
+SMStatus sm_index_insert(SMIndex*, uint64_t key, SM*);
+
+SMStatus sm_index_remove(SMIndex*, uint64_t key);
+
+/* NULL if absent. */
+SM* sm_index_find(SMIndex*, uint64_t key);
+
+/* Looks up `n` keys, prefetching their slots before probing any of them. */
+void sm_index_find_batch(SMIndex*, const uint64_t* keys, size_t n, SM** out);
+
+/* sm_handle on the machine stored under `key`; SM_UNKNOWN_KEY if absent. */
+SMStatus sm_index_handle(SMIndex*, uint64_t key, int, void*);
+
+#ifdef __cplusplus
+}
+#endif
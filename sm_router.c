@@ -0,0 +1,421 @@
+#include "sm_router.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WORD_BITS 64
+#define WORDS(bits) (((bits) + WORD_BITS - 1) / WORD_BITS)
+#define BIT(i) ((uint64_t)1 << ((i) % WORD_BITS))
+
+typedef struct SMRouterSlot SMRouterSlot;
+typedef struct SMTopicList SMTopicList;
+
+/* `version` is the published version the machine's bits were last derived
+ * from; the state handles of any other may mean different states. */
+struct SMRouterSlot {
+    SM* sm;
+    SMRouter* router;
+    size_t id;
+    unsigned version;
+};
+
+struct SMTopicList {
+    size_t* topics;
+    size_t len;
+};
+
+/* Per topic, `live` has a bit for every machine that gets its events and
+ * `summary` a bit for every non-zero word of `live`. `direct` remembers who
+ * subscribed directly, so leaving a subscribed state does not drop them.
+ * `state_topics` is indexed by handles of version `topics_version`, 0 until
+ * an attached machine first reports one. */
+struct SMRouter {
+    size_t topics_len;
+    size_t machines_len;
+    size_t words_len;
+    size_t summary_len;
+    uint64_t* live;
+    uint64_t* summary;
+    uint64_t* direct;
+    SMRouterSlot* slots;
+    SMTopicList* state_topics;
+    size_t state_topics_len;
+    unsigned topics_version;
+};
+
+static void on_transition(SM*, SMStateHdl, SMStateHdl, void*);
+static void leave_state(SMRouter*, SM*, size_t, SMStateHdl);
+static void enter_state(SMRouter*, SM*, size_t, SMStateHdl);
+static void resync(SMRouter*, SM*, size_t, SMStateHdl);
+static void retarget(SMRouter*, SM*, unsigned);
+static bool in_step(SMRouter*, size_t);
+static unsigned version_of(SM*);
+static SMTopicList* topics_of(SMRouter*, SMStateHdl);
+static void set_live(SMRouter*, size_t, size_t);
+static void clear_live(SMRouter*, size_t, size_t);
+static bool valid_id(SMRouter*, size_t);
+
+SMStatus sm_router_create(SMRouter** out, size_t topics, size_t machines) {
+    SMRouter* router = calloc(1, sizeof(*router));
+
+    if (router == NULL) {
+        return SM_ERROR;
+    }
+
+    router->topics_len = topics;
+    router->machines_len = machines;
+    router->words_len = WORDS(machines);
+    router->summary_len = WORDS(router->words_len);
+    router->live = calloc(topics * router->words_len, sizeof(uint64_t));
+    router->direct = calloc(topics * router->words_len, sizeof(uint64_t));
+    router->summary = calloc(topics * router->summary_len, sizeof(uint64_t));
+    router->slots = calloc(machines, sizeof(*router->slots));
+
+    if (!(router->live && router->direct && router->summary 
+          && router->slots)) {
+        sm_router_destroy(router);
+
+        return SM_ERROR;
+    }
+
+    *out = router;
+
+    return SM_OK;
+}
+
+void sm_router_destroy(SMRouter* router) {
+    for (size_t i = 0; router->slots && i < router->machines_len; i++) {
+        if (router->slots[i].sm) {
+            sm_set_observer(router->slots[i].sm, NULL, NULL);
+        }
+    }
+
+    for (size_t i = 0; i < router->state_topics_len; i++) {
+        free(router->state_topics[i].topics);
+    }
+
+    free(router->state_topics);
+    free(router->live);
+    free(router->direct);
+    free(router->summary);
+    free(router->slots);
+    free(router);
+}
+
+SMStatus sm_router_attach(SMRouter* router, SM* sm, size_t* id) {
+    size_t i = 0;
+
+    while (i < router->machines_len && router->slots[i].sm) {
+        i++;
+    }
+
+    if (i == router->machines_len) {
+        return SM_ERROR;
+    }
+
+    router->slots[i] = (SMRouterSlot) {.sm = sm, .router = router, .id = i, 
+        .version = version_of(sm)};
+    sm_set_observer(sm, &on_transition, &router->slots[i]);
+    retarget(router, sm, router->slots[i].version);
+
+    if (in_step(router, i)) {
+        enter_state(router, sm, i, sm_current_state(sm));
+    }
+
+    *id = i;
+
+    return SM_OK;
+}
+
+SMStatus sm_router_detach(SMRouter* router, size_t id) {
+    if (!valid_id(router, id)) {
+        return SM_ERROR;
+    }
+
+    for (size_t t = 0; t < router->topics_len; t++) {
+        router->direct[t * router->words_len + id / WORD_BITS] &= ~BIT(id);
+        clear_live(router, t, id);
+    }
+
+    sm_set_observer(router->slots[id].sm, NULL, NULL);
+    router->slots[id].sm = NULL;
+
+    return SM_OK;
+}
+
+SMStatus sm_router_subscribe(SMRouter* router, size_t id, size_t topic) {
+    if (!valid_id(router, id) || topic >= router->topics_len) {
+        return SM_ERROR;
+    }
+
+    router->direct[topic * router->words_len + id / WORD_BITS] |= BIT(id);
+    set_live(router, topic, id);
+
+    return SM_OK;
+}
+
+SMStatus sm_router_unsubscribe(SMRouter* router, size_t id, size_t topic) {
+    if (!valid_id(router, id) || topic >= router->topics_len) {
+        return SM_ERROR;
+    }
+
+    router->direct[topic * router->words_len + id / WORD_BITS] &= ~BIT(id);
+    clear_live(router, topic, id);
+
+    // Still subscribed through the state it is in
+    if (in_step(router, id)) {
+        enter_state(router, router->slots[id].sm, id, 
+                    sm_current_state(router->slots[id].sm));
+    }
+
+    return SM_OK;
+}
+
+SMStatus sm_router_subscribe_state(SMRouter* router, SMStateHdl hdl, 
+                                   size_t topic) {
+    if (topic >= router->topics_len) {
+        return SM_ERROR;
+    }
+
+    if (hdl >= router->state_topics_len) {
+        size_t len = hdl + 1;
+        SMTopicList* lists = realloc(router->state_topics, 
+                                     sizeof(*lists) * len);
+
+        if (lists == NULL) {
+            return SM_ERROR;
+        }
+
+        memset(&lists[router->state_topics_len], 0, 
+               sizeof(*lists) * (len - router->state_topics_len));
+        router->state_topics = lists;
+        router->state_topics_len = len;
+    }
+
+    SMTopicList* list = &router->state_topics[hdl];
+    size_t* topics = realloc(list->topics, sizeof(*topics) * (list->len + 1));
+
+    if (topics == NULL) {
+        return SM_ERROR;
+    }
+
+    list->topics = topics;
+    list->topics[list->len++] = topic;
+
+    // Machines already in the state pick up the subscription right away; the
+    // ones still on another version do when they move to this one
+    for (size_t i = 0; i < router->machines_len; i++) {
+        if (router->slots[i].sm && in_step(router, i)) {
+            enter_state(router, router->slots[i].sm, i, 
+                        sm_current_state(router->slots[i].sm));
+        }
+    }
+
+    return SM_OK;
+}
+
+SMStatus sm_router_publish(SMRouter* router, size_t topic, int e, 
+                           void* args) {
+    if (topic >= router->topics_len) {
+        return SM_ERROR;
+    }
+
+    uint64_t* live = &router->live[topic * router->words_len];
+    uint64_t* summary = &router->summary[topic * router->summary_len];
+    SMStatus result = SM_OK;
+
+    for (size_t s = 0; s < router->summary_len; s++) {
+        for (uint64_t words = summary[s]; words; words &= words - 1) {
+            size_t w = s * WORD_BITS + __builtin_ctzll(words);
+
+            for (uint64_t bits = live[w]; bits; bits &= bits - 1) {
+                size_t id = w * WORD_BITS + __builtin_ctzll(bits);
+                SMStatus status = sm_handle(router->slots[id].sm, e, args);
+
+                if (result == SM_OK) {
+                    result = status;
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+static void on_transition(SM* sm, SMStateHdl from, SMStateHdl to, void* ctx) {
+    SMRouterSlot* slot = ctx;
+    unsigned version = version_of(sm);
+
+    // After a publish `from` belongs to the previous version, whose parents
+    // are gone, so the machine's state subscriptions are worked out afresh
+    if (version != slot->version) {
+        slot->version = version;
+        retarget(slot->router, sm, version);
+        resync(slot->router, sm, slot->id, to);
+
+        return;
+    }
+
+    leave_state(slot->router, sm, slot->id, from);
+    enter_state(slot->router, sm, slot->id, to);
+}
+
+static void leave_state(SMRouter* router, SM* sm, size_t id, SMStateHdl hdl) {
+    while (hdl != SM_NO_PARENT) {
+        SMTopicList* list = topics_of(router, hdl);
+
+        for (size_t i = 0; list && i < list->len; i++) {
+            size_t t = list->topics[i];
+            uint64_t direct = router->direct[t * router->words_len 
+                                             + id / WORD_BITS];
+
+            if (!(direct & BIT(id))) {
+                clear_live(router, t, id);
+            }
+        }
+
+        if (sm_state_parent(sm, hdl, &hdl) != SM_OK) {
+            break;
+        }
+    }
+}
+
+static void enter_state(SMRouter* router, SM* sm, size_t id, SMStateHdl hdl) {
+    while (hdl != SM_NO_PARENT) {
+        SMTopicList* list = topics_of(router, hdl);
+
+        for (size_t i = 0; list && i < list->len; i++) {
+            set_live(router, list->topics[i], id);
+        }
+
+        if (sm_state_parent(sm, hdl, &hdl) != SM_OK) {
+            break;
+        }
+    }
+}
+
+static void resync(SMRouter* router, SM* sm, size_t id, SMStateHdl hdl) {
+    for (size_t t = 0; t < router->topics_len; t++) {
+        if (!(router->direct[t * router->words_len + id / WORD_BITS] 
+              & BIT(id))) {
+            clear_live(router, t, id);
+        }
+    }
+
+    enter_state(router, sm, id, hdl);
+}
+
+static void retarget(SMRouter* router, SM* sm, unsigned version) {
+    if (version == 0 || version == router->topics_version) {
+        return;
+    }
+
+    // Nothing to translate from until a machine has reported a version
+    if (router->topics_version == 0) {
+        router->topics_version = version;
+
+        return;
+    }
+
+    size_t len = router->state_topics_len;
+    unsigned to = router->topics_version;
+    SMStateHdl* hdls = malloc(sizeof(*hdls) * (len + 1));
+
+    for (size_t i = 0; hdls && i < len; i++) {
+        hdls[i] = i;
+    }
+
+    // On failure the old lists stay, and the next version change retries
+    if (hdls == NULL || sm_translate_states(sm, &to, hdls, len) != SM_OK) {
+        free(hdls);
+
+        return;
+    }
+
+    size_t new_len = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (router->state_topics[i].len && hdls[i] >= new_len) {
+            new_len = hdls[i] + 1;
+        }
+    }
+
+    SMTopicList* lists = calloc(new_len + 1, sizeof(*lists));
+
+    if (lists == NULL) {
+        free(hdls);
+
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        SMTopicList* list = &router->state_topics[i];
+        SMTopicList* dst = &lists[hdls[i]];
+
+        // Subscriptions go along with their state, and away with it if the
+        // migration drops it
+        if (list->len == 0 || (hdls[i] == SM_NO_PARENT && i != SM_NO_PARENT)) {
+            free(list->topics);
+        } else if (dst->len == 0) {
+            *dst = *list;
+        } else {
+            size_t* topics = realloc(dst->topics, 
+                                     sizeof(*topics) * (dst->len + list->len));
+
+            if (topics) {
+                memcpy(&topics[dst->len], list->topics, 
+                       sizeof(*topics) * list->len);
+                dst->topics = topics;
+                dst->len += list->len;
+            }
+
+            free(list->topics);
+        }
+    }
+
+    free(router->state_topics);
+    free(hdls);
+    router->state_topics = lists;
+    router->state_topics_len = new_len;
+    router->topics_version = to;
+}
+
+static bool in_step(SMRouter* router, size_t id) {
+    return router->slots[id].version == router->topics_version;
+}
+
+static unsigned version_of(SM* sm) {
+    SMSnapshot snapshot;
+    sm_snapshot(sm, &snapshot);
+
+    return snapshot.version;
+}
+
+static SMTopicList* topics_of(SMRouter* router, SMStateHdl hdl) {
+    return (hdl < router->state_topics_len) ? &router->state_topics[hdl] 
+                                            : NULL;
+}
+
+static void set_live(SMRouter* router, size_t topic, size_t id) {
+    size_t w = id / WORD_BITS;
+
+    router->live[topic * router->words_len + w] |= BIT(id);
+    router->summary[topic * router->summary_len + w / WORD_BITS] |= BIT(w);
+}
+
+static void clear_live(SMRouter* router, size_t topic, size_t id) {
+    size_t w = id / WORD_BITS;
+    uint64_t* word = &router->live[topic * router->words_len + w];
+
+    *word &= ~BIT(id);
+
+    if (*word == 0) {
+        router->summary[topic * router->summary_len + w / WORD_BITS] &= ~BIT(w);
+    }
+}
+
+static bool valid_id(SMRouter* router, size_t id) {
+    return id < router->machines_len && router->slots[id].sm;
+}
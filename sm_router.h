@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "sm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Delivers events published on a topic to just the attached machines
+ * subscribed to it. A machine is subscribed either directly, or by being in
+ * a state (or a substate of one) subscribed to the topic; the latter follows
+ * its transitions automatically. State subscriptions apply to every attached
+ * machine, so they suit routers whose machines share one definition layout.
+ * They name states of the version the machines last ran, and move along with
+ * the machines to newly published versions (see sm_translate_states); those
+ * of states a migration drops are dropped. Publishing walks a two-level
+ * bitmap per topic, so its cost tracks the number of subscribers rather than
+ * of attached machines. Not thread-safe: the router is updated from the
+ * observer, so use it on the thread that dispatches the attached machines.
+ * Attaching takes over the machine's observer. */
+typedef struct SMRouter SMRouter;
+
+SMStatus sm_router_create(SMRouter**, size_t topics, size_t machines);
+
+void sm_router_destroy(SMRouter*);
+
+SMStatus sm_router_attach(SMRouter*, SM*, size_t* id);
+
+SMStatus sm_router_detach(SMRouter*, size_t id);
+
+SMStatus sm_router_subscribe(SMRouter*, size_t id, size_t topic);
+
+SMStatus sm_router_unsubscribe(SMRouter*, size_t id, size_t topic);
+
+SMStatus sm_router_subscribe_state(SMRouter*, SMStateHdl, size_t topic);
+
+/* Handles the event on every subscriber, even after one fails; returns the
+ * first failure. */
+SMStatus sm_router_publish(SMRouter*, size_t topic, int, void*);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,333 @@
+#define _DEFAULT_SOURCE
+
+#include "sm_shm.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SHM_MAGIC 0x534D5348u
+#define CACHE_LINE 64
+#define ALIGN_UP(size, align) (((size) + (align) - 1) & ~((size_t)(align) - 1))
+
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+               "shared instances need address-free atomics");
+
+typedef struct SMShmHeader SMShmHeader;
+typedef struct SMShmSlot SMShmSlot;
+
+/* Everything in the segment is found by offset from its start, since each
+ * process may map it at a different address. */
+struct SMShmHeader {
+    atomic_uint magic;
+    size_t len;
+    size_t slot_size;
+    size_t slots_off;
+    atomic_ullong def_id;
+};
+
+/* One slot per cache line (or more), so workers advancing neighbouring
+ * instances do not contend. The instance storage follows the slot header.
+ * Holding `lock` is the claim; being robust, it is handed to the next claimer
+ * with EOWNERDEAD when its holder dies, however its pid is reused. `owner`
+ * tells the holder apart from other threads, in any pid namespace. */
+struct SMShmSlot {
+    pthread_mutex_t lock;
+    atomic_ullong owner;
+};
+
+struct SMShm {
+    SMShmHeader* header;
+    size_t size;
+};
+
+static SMStatus map(SMShm**, int, size_t);
+static size_t slot_size(void);
+static size_t instance_off(void);
+static SMShmSlot* get_slot(const SMShm*, size_t);
+static void* get_instance(const SMShm*, size_t);
+static bool owned(const SMShm*, size_t);
+static unsigned long long self_token(void);
+static SMStatus check_definition(SMShm*, SM*);
+
+SMStatus sm_shm_create(SMShm** out, const char* name, size_t instances) {
+    size_t slots_off = ALIGN_UP(sizeof(SMShmHeader), CACHE_LINE);
+    size_t size = slots_off + instances * slot_size();
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+
+    if (fd < 0) {
+        return SM_ERROR;
+    }
+
+    if (ftruncate(fd, size) || map(out, fd, size) != SM_OK) {
+        close(fd);
+        shm_unlink(name);
+
+        return SM_ERROR;
+    }
+
+    close(fd);
+
+    SMShmHeader* header = (*out)->header;
+    header->len = instances;
+    header->slot_size = slot_size();
+    header->slots_off = slots_off;
+    atomic_init(&header->def_id, 0);
+
+    pthread_mutexattr_t attr;
+    bool failed = pthread_mutexattr_init(&attr) != 0;
+
+    failed = failed 
+        || pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)
+        || pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+    for (size_t i = 0; !failed && i < instances; i++) {
+        failed = pthread_mutex_init(&get_slot(*out, i)->lock, &attr) != 0;
+        atomic_init(&get_slot(*out, i)->owner, 0);
+        sm_instance_init(get_instance(*out, i));
+    }
+
+    pthread_mutexattr_destroy(&attr);
+
+    if (failed) {
+        sm_shm_close(*out);
+        shm_unlink(name);
+
+        return SM_ERROR;
+    }
+
+    // Openers check the magic last, so they never see a half-built segment
+    atomic_store(&header->magic, SHM_MAGIC);
+
+    return SM_OK;
+}
+
+SMStatus sm_shm_open(SMShm** out, const char* name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    struct stat st;
+
+    if (fd < 0) {
+        return SM_ERROR;
+    }
+
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(SMShmHeader) 
+        || map(out, fd, st.st_size) != SM_OK) {
+        close(fd);
+
+        return SM_ERROR;
+    }
+
+    close(fd);
+
+    SMShmHeader* header = (*out)->header;
+
+    // Built by a different layout of SMInstance, or not built yet
+    if (atomic_load(&header->magic) != SHM_MAGIC 
+        || header->slot_size != slot_size()
+        || header->slots_off + header->len * header->slot_size > (*out)->size) {
+        sm_shm_close(*out);
+
+        return SM_ERROR;
+    }
+
+    return SM_OK;
+}
+
+void sm_shm_close(SMShm* shm) {
+    munmap(shm->header, shm->size);
+    free(shm);
+}
+
+SMStatus sm_shm_unlink(const char* name) {
+    return shm_unlink(name) ? SM_ERROR : SM_OK;
+}
+
+size_t sm_shm_len(const SMShm* shm) {
+    return shm->header->len;
+}
+
+SMStatus sm_shm_claim(SMShm* shm, size_t i) {
+    if (i >= shm->header->len) {
+        return SM_ERROR;
+    }
+
+    SMShmSlot* slot = get_slot(shm, i);
+    unsigned long long self = self_token();
+
+    if (atomic_load(&slot->owner) == self) {
+        return SM_OK;
+    }
+
+    switch (pthread_mutex_trylock(&slot->lock)) {
+        case 0:
+            break;
+        case EOWNERDEAD:
+            // Taken over from a dead owner, which may have died mid-transition
+            sm_instance_recover(get_instance(shm, i));
+            pthread_mutex_consistent(&slot->lock);
+            break;
+        case EBUSY:
+            return SM_BUSY;
+        default:
+            return SM_ERROR;
+    }
+
+    atomic_store(&slot->owner, self);
+
+    return SM_OK;
+}
+
+SMStatus sm_shm_release(SMShm* shm, size_t i) {
+    if (i >= shm->header->len) {
+        return SM_ERROR;
+    }
+
+    SMShmSlot* slot = get_slot(shm, i);
+
+    if (atomic_load(&slot->owner) != self_token()) {
+        return SM_BUSY;
+    }
+
+    atomic_store(&slot->owner, 0);
+    pthread_mutex_unlock(&slot->lock);
+
+    return SM_OK;
+}
+
+SMStatus sm_shm_handle(SMShm* shm, size_t i, SM* sm, int e, void* args) {
+    if (!owned(shm, i)) {
+        return SM_BUSY;
+    }
+
+    SMStatus status = check_definition(shm, sm);
+
+    if (status != SM_OK) {
+        return status;
+    }
+
+    return sm_handle_instance(sm, get_instance(shm, i), e, args);
+}
+
+SMStatus sm_shm_set_state(SMShm* shm, size_t i, SM* sm, SMStateHdl hdl) {
+    if (!owned(shm, i)) {
+        return SM_BUSY;
+    }
+
+    SMStatus status = check_definition(shm, sm);
+
+    if (status != SM_OK) {
+        return status;
+    }
+
+    return sm_set_state_instance(sm, get_instance(shm, i), hdl);
+}
+
+void sm_shm_snapshot(const SMShm* shm, size_t i, SMSnapshot* out) {
+    sm_instance_snapshot(get_instance(shm, i), out);
+}
+
+static SMStatus map(SMShm** out, int fd, size_t size) {
+    SMShm* shm = malloc(sizeof(*shm));
+
+    if (shm == NULL) {
+        return SM_ERROR;
+    }
+
+    shm->header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    shm->size = size;
+
+    if (shm->header == MAP_FAILED) {
+        free(shm);
+
+        return SM_ERROR;
+    }
+
+    *out = shm;
+
+    return SM_OK;
+}
+
+static size_t slot_size(void) {
+    return ALIGN_UP(instance_off() + sm_instance_size(), CACHE_LINE);
+}
+
+static size_t instance_off(void) {
+    return ALIGN_UP(sizeof(SMShmSlot), _Alignof(max_align_t));
+}
+
+static SMShmSlot* get_slot(const SMShm* shm, size_t i) {
+    char* base = (char*)shm->header;
+
+    return (SMShmSlot*)(base + shm->header->slots_off 
+                        + i * shm->header->slot_size);
+}
+
+static void* get_instance(const SMShm* shm, size_t i) {
+    return (char*)get_slot(shm, i) + instance_off();
+}
+
+static bool owned(const SMShm* shm, size_t i) {
+    return i < shm->header->len 
+        && atomic_load(&get_slot(shm, i)->owner) == self_token();
+}
+
+static unsigned long long self_token(void) {
+    static _Thread_local unsigned long long token;
+    static _Thread_local pid_t pid;
+
+    // A forked child inherits its parent's token, so it draws its own
+    while (token == 0 || pid != getpid()) {
+        pid = getpid();
+
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            token = 0;
+        }
+    }
+
+    return token;
+}
+
+static SMStatus check_definition(SMShm* shm, SM* sm) {
+    unsigned long long id;
+    SMStatus status = sm_definition_id(sm, &id);
+
+    if (status != SM_OK) {
+        return status;
+    }
+
+    unsigned long long current = atomic_load(&shm->header->def_id);
+
+    // The first dispatch settles the definition; a process whose version
+    // follows the segment's moves it on, and the instances migrate as they
+    // are dispatched. Processes left behind are turned away.
+    while (current != id) {
+        bool follows = current == 0;
+
+        if (!follows) {
+            status = sm_definition_follows(sm, current, &follows);
+        }
+
+        if (status != SM_OK) {
+            return status;
+        }
+
+        if (!follows) {
+            return SM_DEFINITION_MISMATCH;
+        }
+
+        if (atomic_compare_exchange_weak(&shm->header->def_id, &current, id)) {
+            break;
+        }
+    }
+
+    return SM_OK;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "sm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A POSIX shared-memory segment of machine instances that pre-forked workers
+ * advance together. Every process builds and publishes the same definitions,
+ * with the same migration maps, in its own SM and dispatches through it; only
+ * the instances are shared.
+ * The segment records which published version (see sm_definition_id) its
+ * instances follow, and dispatch by a process that published something else
+ * fails with SM_DEFINITION_MISMATCH, except that a process whose version
+ * follows the segment's (sm_definition_follows) moves the segment on to it.
+ * A thread claims an instance before dispatching it, so exactly one thread
+ * advances a given instance at a time, and may take over an instance whose
+ * owner (the claiming thread) has died. Claims must be released before the
+ * segment is closed. */
+typedef struct SMShm SMShm;
+
+SMStatus sm_shm_create(SMShm**, const char* name, size_t instances);
+
+SMStatus sm_shm_open(SMShm**, const char* name);
+
+void sm_shm_close(SMShm*);
+
+SMStatus sm_shm_unlink(const char* name);
+
+size_t sm_shm_len(const SMShm*);
+
+/* SM_BUSY if another live thread owns the instance. */
+SMStatus sm_shm_claim(SMShm*, size_t);
+
+SMStatus sm_shm_release(SMShm*, size_t);
+
+/* Dispatch on an instance claimed by this thread; SM_BUSY otherwise, or if
+ * another thread is dispatching through the same SM, so each thread needs an
+ * SM of its own (publishing the same definitions). The SM is only borrowed
+ * for the call: sm_current_state and sm_snapshot on it keep reporting its own
+ * instance, so observers of shared instances use sm_shm_snapshot. */
+SMStatus sm_shm_handle(SMShm*, size_t, SM*, int, void*);
+
+SMStatus sm_shm_set_state(SMShm*, size_t, SM*, SMStateHdl);
+
+/* Safe from any process, claimed or not. */
+void sm_shm_snapshot(const SMShm*, size_t, SMSnapshot*);
+
+#ifdef __cplusplus
+}
+#endif